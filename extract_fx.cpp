@@ -2,533 +2,478 @@
 // By bengt.gustafsson@beamways.com
 // MIT license.
 
-#include <filesystem>
+#include "extract_fx.h"
+
 #include <iostream>
 #include <fstream>
-#include <string>
-#include <string_view>
-#include <cassert>
-#include <format>
-
-class FxExtractor {
+#include <sstream>
+#include <memory>
+#include <numeric>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
+
+// Read only view of an entire input file. The file is memory mapped if possible, otherwise it is read in one go.
+class MappedFile {
 public:
-    class EarlyEnd : public std::runtime_error {
-        using std::runtime_error::runtime_error;
-    };
-    class ParsingError : public std::runtime_error {
-    public:
-        ParsingError(int lineno, std::string_view msg) : std::runtime_error(std::format("Line {}: {}", lineno, msg)) {}
-    };
-
-    FxExtractor(std::ostream& outFile, std::istream& inFile, const std::filesystem::path& sourceFile, const std::string& functionName, bool lineDirectives) : m_outFile(outFile), m_inFile(inFile), m_sourceFile(sourceFile), m_functionName(functionName), m_lineDirectives(lineDirectives) {}
-
-    bool process() {
-        try {
-            tryProcess();
-            return true;
+    explicit MappedFile(const std::filesystem::path& path) {
+#ifdef _WIN32
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+            HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping != nullptr) {
+                m_data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                CloseHandle(mapping);       // The view keeps the mapping alive.
+                m_size = size_t(size.QuadPart);
+            }
         }
-
-        catch (const std::runtime_error& ex) {
-            std::cerr << ex.what() << "\n";
+        CloseHandle(file);
+        m_isOpen = m_data != nullptr || size.QuadPart == 0;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            m_size = size_t(st.st_size);
+            if (m_size > 0) {
+                void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    m_data = static_cast<const char*>(data);
+                    ::madvise(data, m_size, MADV_SEQUENTIAL);
+                }
+            }
+            m_isOpen = m_data != nullptr || m_size == 0;
+        }
+        ::close(fd);
+#endif
+        if (!m_isOpen) {        // Not mappable, for instance a pipe. Fall back to reading it all.
+            std::ifstream in(path, std::ios::binary);
+            if (in) {
+                m_fallback = readAll(in);
+                m_isOpen = true;
+            }
         }
-
-        return false;
     }
 
-    void tryProcess() {
-        std::string outLine;
-
-        if (!m_inFile)
-            throw std::runtime_error("Could not open file.");
-        
-        getNextLine();
-        m_outFile << makeLineDirective(1, 0);
-
-        bool saved = m_lineDirectives;      // Save m_lineDirectives to be able to restore it at end of line.
-
-        while (peek() != '\0') {        // Process all lines
-            // Scan for string literals, skipping comments. For now don't skip #ifdef'ed out lines
-            bool continuation = false;      // No non-whitespace character since last backslash (i.e. potential continuation line)
-            bool first = true;              // No non-whitespace character since line start (i.e. potential preprocessor directive)
-            while (peek() != '\n' && peek() != '\0') {
-                switch (peek()) {
-                case '"':
-                    processStringLiteral();
-                    break;
-
-                case '\'':
-                    processCharLiteral();
-                    break;
+    ~MappedFile() {
+        if (m_data == nullptr)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        ::munmap(const_cast<char*>(m_data), m_size);
+#endif
+    }
 
-                case '/':               // Check for comments.
-                    if (peek(1) == '*') {
-                        processCComment();  //  C comments don't need \ last on lines even if this expression is inside a non-raw literal.
-                        break;
-                    }
-                    else if (peek(1) == '/') {
-                        processCPPComment();  //  C++ comments support \ last on lines regardless of if the enclosing literal is raw or not.
-                        break;
-                    }
-                    [[fallthrough]];    // No comment start
-
-                case '\\':
-                    continuation = true;
-                    xfer();
-                    break;
-
-                case '#':
-                    if (first)
-                        m_lineDirectives = false;       // This is a preprocessor directive. We can't do #line in them even if enabled.
-
-                    xfer();
-                    break;
-                    
-                default:
-                    if (!isspace()) {
-                        first = false; 
-                        continuation = false;
-                    }
-                    
-                    xfer();
-                }
-            }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-            m_outFile << m_outLines;
-            if (!m_inFile.eof())            // Preserve lack of last \n char in input.
-                m_outFile << next();
+    bool isOpen() const { return m_isOpen; }
+    std::string_view view() const { return m_data != nullptr ? std::string_view(m_data, m_size) : std::string_view(m_fallback); }
 
-            m_outLines.clear();
-            if (!continuation)              // Don't restore if the preprocessor directive continues
-                m_lineDirectives = saved;
-        }
+    // Read the entire contents of a stream in one shot, used for stdin.
+    static std::string readAll(std::istream& in) {
+        std::ostringstream buffer;
+        buffer << in.rdbuf();
+        return std::move(buffer).str();
     }
 
 private:
-    // Descriptor of each expression field including where it starts to be able to add #line directive
-    // ensuring that C++ error messages are appointed to the right position.
-    struct Field {
-        int line;
-        int col;
-        std::string expression;
-    };
-
-    bool getNextLine() {
-        getline(m_inFile, m_inLine);
-        m_lineNo++;
-        if (!m_inFile.eof())
-            m_inLine += '\n';
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    std::string m_fallback;     // Contents if the file could not be mapped.
+    bool m_isOpen = false;
+};
 
-        m_ptr = m_inLine.c_str();
-        return true;
+// Fixed set of worker threads executing submitted jobs in order of submission.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threadCount) {
+        for (unsigned i = 0; i < std::max(threadCount, 1u); i++)
+            m_threads.emplace_back([this] { work(); });
     }
 
-    char peek() { return *m_ptr; }
-    char peek(size_t offset) { return m_ptr[offset]; }
-
-    char next() {
-        if (*m_ptr == '\n' || *m_ptr == '\0') {
-            getNextLine();
-            return '\n';
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
         }
-
-        return *m_ptr++;
+        m_wakeup.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
     }
 
-    void xfer() {
-        char c = next();
-        m_outLines += c;
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard lock(m_mutex);
+            m_jobs.push_back(std::move(job));
+        }
+        m_wakeup.notify_one();
     }
 
-    bool isspace() { return std::isspace(static_cast<unsigned char>(peek())); }
-
-    std::string makeLineDirective(int line, int col) {
-        if (!m_lineDirectives)
-            return {};
-        
-        return std::format("\n#line {} \"{}\"\n{}", line, m_sourceFile.string(), std::string(col, ' '));
+    // Block until all submitted jobs have finished.
+    void wait() {
+        std::unique_lock lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_jobs.empty() && m_busy == 0; });
     }
 
-    void processCPPComment() {
-        assert(peek() == '/' && peek(1) == '/');
-        xfer();
-        xfer();
-
-        bool backslash = false;     // Set when the last non-whitespace character is a backslash.
-        while (peek() != '\n' || backslash) {            // Comment can have continuation lines...
-            if (peek() == '\0') {
-                if (backslash)
-                    throw EarlyEnd("Input ends with a // comment line ending in \\.");
-                else
-                    return;     // Comment line last in file. This is ok.
-            }
-            else if (peek() == '\\')
-                backslash = true;
-            else if (peek() == '\n' || !isspace())
-                backslash = false;
+    static unsigned defaultThreadCount() { return std::max(std::thread::hardware_concurrency(), 1u); }
 
-            xfer();
+private:
+    void work() {
+        std::unique_lock lock(m_mutex);
+        while (true) {
+            m_wakeup.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+            if (m_jobs.empty())
+                return;         // Stopping and nothing more to do.
+
+            auto job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_busy++;
+            lock.unlock();
+            job();
+            lock.lock();
+            m_busy--;
+            if (m_jobs.empty() && m_busy == 0)
+                m_idle.notify_all();
         }
     }
 
-    void processCComment() {
-        assert(peek() == '/' && peek(1) == '*');
-        xfer();
-        xfer();
-        
-        while (peek() != '*' || peek(1) != '/') {
-            if (peek() == '\0')
-                throw EarlyEnd("/* unmatched to the end of the input.");
-
-            xfer();
-        }
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;       // Signalled when a job is added or the pool is stopped.
+    std::condition_variable m_idle;         // Signalled when the last running job finishes.
+    std::deque<std::function<void()>> m_jobs;
+    unsigned m_busy = 0;                    // Number of jobs currently running.
+    bool m_stop = false;
+    std::vector<std::thread> m_threads;
+};
 
-        xfer();
-        xfer();
+// Watches files for changes, for --watch. The directories of the files are watched using inotify on Linux and ReadDirectoryChangesW
+// on Windows, which also sees files saved by renaming a new file over them. Elsewhere the time stamps of the files are polled.
+class FileWatcher {
+public:
+    FileWatcher() {
+#if defined(_WIN32)
+        m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+#elif defined(__linux__)
+        m_fd = inotify_init1(IN_CLOEXEC);
+#endif
     }
 
-    // Move char literal starting at s to out without touching any of its contents.
-    void processCharLiteral() { processLiteral(false, '\0', "", '\''); }
-
-    // Process a string literal including its prefix.
-    void processStringLiteral() {
-        bool raw = false;
-        size_t pos = m_outLines.size();
-        if (pos > 0 && m_outLines[pos - 1] == 'R') {
-            raw = true;
-            pos--;
-        }
-
-        char fx = 0;
-        std::string encoding;
-        if (pos > 0) {
-            char c = std::tolower(static_cast<unsigned char>(m_outLines[pos - 1]));
-            if (c == 'f' || c == 'x') {
-                fx = c;
-                pos--;
-            }
-
-            // For f literals) we must be able to move the encoding prefix inside the std::format(
-            // call.
-            if (fx == 'f' && pos > 0) {
-                switch (m_outLines[pos - 1]) {
-                case 'L':
-                case 'U':
-                case 'u':
-                    encoding += m_outLines[pos - 1];
-                    pos--;
-                    break;
-
-                case '8':
-                    if (pos > 1 && m_outLines[pos - 2] == 'u') {
-                        encoding ="u8";
-                        pos -= 2;
-                    }
-                };
+    ~FileWatcher() {
+#if defined(_WIN32)
+        for (auto& [path, dir] : m_dirs) {
+            if (dir->pending) {
+                DWORD bytes;
+                CancelIoEx(dir->handle, &dir->overlapped);
+                GetOverlappedResult(dir->handle, &dir->overlapped, &bytes, TRUE);      // The buffer must outlive the read.
             }
+            CloseHandle(dir->handle);
         }
-
-        m_outLines.erase(pos);
-        processLiteral(raw, fx, encoding, '"');
+        if (m_port != nullptr)
+            CloseHandle(m_port);
+#elif defined(__linux__)
+        if (m_fd >= 0)
+            ::close(m_fd);
+#endif
     }
 
-    // Process a char or string literal according to raw mode, f/x mode and terminator, prepending encoding where appropriate.
-    void processLiteral(bool raw, char fx, const std::string& encoding, char terminator) {
-        std::string prefix;
-
-        assert(peek() == terminator);
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
 
-        std::string lit;
-
-        auto toLit = [&] {
-            lit += next();
-        };
-
-        // Handle start of literal
-        if (raw) {
-            lit += 'R';
-            toLit();
-            
-            // Collect prefix
-            while (peek() != '(') {
-                if (peek() == '\0' || peek() == '\n')
-                    throw ParsingError(m_lineNo, " ends in a raw literal prefix. There must be a ( before the end of line after R\".");
-
-                prefix += next();
-            }
-            lit += prefix;
-            toLit();
-        }
-        else
-            toLit();         // add quote
+    // Watch file, given as an absolute normalized path. Returns false if its directory can't be watched.
+    bool watch(const std::filesystem::path& file) {
+        std::error_code ec;
+        if (!m_files.try_emplace(file, std::filesystem::last_write_time(file, ec)).second)
+            return true;
 
-        // Process the actual literal contents.
-        std::vector<Field> fields;       // Can't be string_views as R literals span lines and we only store the last line.
-        bool backslash = false;         // Only used in non-raw case
-        while (true) {
-            if (raw) {      // Pass raw line ends and try to find prefix
-                if (peek() == 0)
-                    throw EarlyEnd("Input ends in raw literal.");
-
-                if (peek() == ')') {       // Look for prefix after ) and " after that.
-                    size_t pix = 0;
-                    while (pix < prefix.size()) {
-                        if (peek(pix + 1) != prefix[pix])   // Note: as prefix can't contain \n or \0 we can always pre-see characters until comparison fails or prefix is complete.
-                            break;
-                        
-                        pix++;
-                    }
-                    if (pix == prefix.size() && peek(pix + 1) == terminator) {
-                        // Raw literal ended
-                        toLit();  // The )
-                        lit += prefix;
-                        m_ptr += prefix.size();
-                        break;
-                    }
-                }
-            }
-            else {      // Handle continuation lines and escaped quotes in non-raw literals
-                if (peek() == '\\')
-                    backslash = !backslash;
-                else if (peek() == terminator) {
-                    if (backslash)
-                        backslash = false;
-                    else
-                        break;          // Literal ended
-                }
-                else if (peek() == '\0')
-                    throw EarlyEnd("Input ends inside a char or string literal.");
-                else if (!backslash && peek() == '\n')
-                    throw ParsingError(m_lineNo, "Input line ends inside a char or string literal.");
-                else if (peek() == '\n' || !isspace())
-                    backslash = false;
-            }
-            
-            if (fx != '\0') {
-                if (peek() == '{') {
-                    next();
-                    if (peek() != '{')
-                        processExtractionField(lit, fields);
-                    else
-                        lit += '{';   // The first { transferred for double left braces. The second is transferred as the "normal" literal character.
-                }
-                else if (peek() == '}') {
-                    toLit();      // Transfer the first } to the resulting string
-                    if (peek() != '}')
-                        throw ParsingError(m_lineNo, "Right brace characters must be doubled in f/x string literals.");
-                }
-            }
+        return watchDirectory(file.parent_path());
+    }
 
-            toLit();      // A regular literal character
+    // Wait until watched files change, and then until no more changes arrive for quietMs milliseconds, so that a burst of changes
+    // is returned together. Returns nothing if no file changes within timeoutMs milliseconds, unless it is negative, or on errors.
+    std::set<std::filesystem::path> wait(int quietMs, int timeoutMs = -1) {
+        std::set<std::filesystem::path> changed;
+        if (readChanges(timeoutMs, changed)) {
+            while (readChanges(quietMs, changed))
+                ;
         }
+        return changed;
+    }
 
-        toLit();      // Transfer the ending quote
-
-        if (fx != '\0') {
-            // Output the std::format( for f literals only
-            if (fx == 'f') {
-                if (m_functionName.back() == '*')
-                    m_outLines += m_functionName.substr(0, m_functionName.size() - 1) + '<' + std::to_string(fields.size()) + '>';
-                else
-                    m_outLines += m_functionName;
-
-                m_outLines += "(" + encoding;
-            }
-
-            m_outLines += lit;
-            // Emit all extracted field expressions.
-            for (auto& field : fields) {
-                m_outLines += makeLineDirective(field.line, field.col - 2);   // Subtract 2 for the , we add before the field below.
-                m_outLines += ", " + field.expression;
+private:
+    // Add changes to changed until a watched file changes, then return true, or return false after timeoutMs milliseconds.
+    bool readChanges(int timeoutMs, std::set<std::filesystem::path>& changed) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        size_t count = changed.size();
+        while (changed.size() == count) {
+            int remaining = timeoutMs;
+            if (timeoutMs > 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                remaining = int(std::max<int64_t>(left.count(), 0));
             }
-
-            if (fx == 'f')
-                m_outLines += ")";
+            if (!readEvents(remaining, changed))
+                return false;
         }
-        else
-            m_outLines += lit;
+        return true;
     }
 
-    // Parse an extraction field and add its contained expression(s) to fields. Return the remaining literal part such as {} or {:xxx}
-    void processExtractionField(std::string& lit, std::vector<Field>& fields) {
-        Field field = processExpressionField();
-        // Check for expression-field ending in = +optional spaces.
-        size_t pos = field.expression.size();
-        while (pos > 0 && std::isspace(static_cast<unsigned char>(field.expression[pos - 1])))
-            pos--;
-
-        if (field.expression[pos - 1] == '=') {  // Debug style field where expression ends in =
-            lit += field.expression;
-            field.expression.erase(pos - 1);   // Remove = and trailing spaces from field.
-        }
-
-        lit += '{';     // After automatically generated label, if any.
-
-        auto toLit = [&] {
-            lit += next();
-        };
+    void fileChanged(const std::filesystem::path& file, std::set<std::filesystem::path>& changed) const {
+        if (m_files.contains(file))
+            changed.insert(file);
+    }
 
-        fields.push_back(std::move(field));
-        // If : check for nested fields in the format-spec
-        if (peek() == ':') {
-            toLit();      // Transfer the : to the resulting string
-            while (peek() != '}') {
-                if (peek() == '\0')
-                    EarlyEnd("Input ends inside format-spec");
+    // Events were lost, any file may have changed.
+    void allChanged(std::set<std::filesystem::path>& changed) const {
+        for (auto& file : m_files)
+            changed.insert(file.first);
+    }
 
-                if (peek() == '{') {    // Nested field starts
-                    toLit();
+#if defined(_WIN32)
+    struct Directory {
+        std::filesystem::path path;
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped = {};
+        bool pending = false;
+        alignas(DWORD) char buffer[64 * 1024];      // Larger buffers fail for network drives.
+    };
 
-                    // Find the end of the expression-field. Basically scan for : or } but ignore as many colons as there are ? and
-                    // skip through all parentheses, except in string literals.
-                    Field field = processExpressionField();
-                    if (peek() != '}')   // Colon not allowed inside nested expression-field.
-                        throw ParsingError(m_lineNo, "Found nested expression-field ending in :. This is not allowed.");
+    bool watchDirectory(const std::filesystem::path& path) {
+        if (m_dirs.contains(path))
+            return true;
+        if (m_port == nullptr)
+            return false;
 
-                    fields.push_back(std::move(field));
-                }
+        auto dir = std::make_unique<Directory>();
+        dir->path = path;
+        dir->handle = CreateFileW(path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                  OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        if (dir->handle == INVALID_HANDLE_VALUE)
+            return false;
 
-                toLit();      // Transfer other formatting argument char to the resulting string
-            }
+        if (CreateIoCompletionPort(dir->handle, m_port, ULONG_PTR(dir.get()), 0) == nullptr || !read(*dir)) {
+            CloseHandle(dir->handle);
+            return false;
         }
-    }
-    
-    // Parse a top level part of an expression field until a colon or right brace is encountered. Ignore double colons, recurse on
-    // ?, (, [, {.
-    // Pre: just after {
-    // Post: peek() == '}' or ':'
-    Field processExpressionField() {
-        Field ret;            // Field to return
-        ret.line = m_lineNo;
-        ret.col = int(m_ptr - m_inLine.c_str());
-
-        std::string save = std::move(m_outLines);
-        m_outLines.clear();
-
-        // Another level required to handle ?: ternaries without redoing the save operation.
-        processExpression();
-
-        ret.expression = std::move(m_outLines);
-        m_outLines = std::move(save);
-        return ret;
+        m_dirs.emplace(path, std::move(dir));
+        return true;
     }
 
-    void processExpression()
-    {
-        while (true) {
-            processNested();
+    bool read(Directory& dir) {
+        dir.pending = ReadDirectoryChangesW(dir.handle, dir.buffer, sizeof(dir.buffer), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                            nullptr, &dir.overlapped, nullptr) != 0;
+        return dir.pending;
+    }
 
-            switch (peek()) {
-            case ')':
-                throw ParsingError(m_lineNo, "Extraneous ) in expression-field");
+    // Wait for the events of one directory. Returns false on timeout or errors.
+    bool readEvents(int timeoutMs, std::set<std::filesystem::path>& changed) {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* overlapped = nullptr;
+        bool ok = GetQueuedCompletionStatus(m_port, &bytes, &key, &overlapped, timeoutMs < 0 ? INFINITE : DWORD(timeoutMs)) != 0;
+        if (overlapped == nullptr)
+            return false;
 
-            case ']':
-                throw ParsingError(m_lineNo, "Extraneous ] in expression-field");
+        Directory& dir = *reinterpret_cast<Directory*>(key);
+        dir.pending = false;
+        if (!ok)
+            return true;            // The directory is gone, and is no longer watched.
+
+        if (bytes == 0)
+            allChanged(changed);    // The buffer overflowed.
+        for (DWORD offset = 0; bytes != 0; ) {
+            auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(dir.buffer + offset);
+            fileChanged(dir.path / std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR)), changed);
+            if (info->NextEntryOffset == 0)
                 break;
+            offset += info->NextEntryOffset;
+        }
+        read(dir);
+        return true;
+    }
 
-            case '?':
-                xfer();           // TODO: Use m_outLines anyway: We must keep a stack of ongoing outlines by saving it in parseLiteral or somewhere on the way. This is as parseLiteral is called recursively.
-                processExpression();
-                if (peek() != ':')
-                    throw ParsingError(m_lineNo, "Mismatched ? in expression-field");
-
-                xfer();      // Pass :
-                processExpression();
-                return;
-
-            case '}':
-                return;
-                
-            case ':':
-                if (peek(1) != ':')
-                    return;
+    HANDLE m_port = nullptr;
+    std::map<std::filesystem::path, std::unique_ptr<Directory>> m_dirs;
+#elif defined(__linux__)
+    bool watchDirectory(const std::filesystem::path& path) {
+        if (m_fd < 0)
+            return false;
 
-                if (!std::isalpha(static_cast<unsigned char>(peek(2))))
-                    return;
+        int wd = inotify_add_watch(m_fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+            return false;
 
-                xfer();
-                xfer();
-                break;
-                
-            default:
-                xfer();
-                break;      // Nothing to do for other characters.
-            }
-        }
+        m_dirs[wd] = path;
+        return true;
     }
 
-    // Pass over any number of nested comments, literals and matched parentheses, returning the text passed over, which may span lines.
-    // Note: This helper must work on an existing 'ret' as processStringLiteral does so to be able to check for prefixes in the
-    // already passed text. Fortunately prefixes are not allowed to span lines.
-    void processNested()
-    {
-        while (true) {
-            switch (peek()) {
-            case '\0':
-                throw EarlyEnd("Input ends inside an expression-field in a literal.");
-
-            case '(':
-            case '[':
-            case '{':
-                processNestedParenthesis();
-                break;
-
-            case '"':
-                processStringLiteral();
-                break;
+    // Wait for and read the pending events. Returns false on timeout or errors.
+    bool readEvents(int timeoutMs, std::set<std::filesystem::path>& changed) {
+        pollfd fds = { m_fd, POLLIN, 0 };
+        int ready = ::poll(&fds, 1, timeoutMs);
+        if (ready < 0 && errno == EINTR)
+            return true;
+        if (ready <= 0 || m_fd < 0)
+            return false;
 
-            case '\'':
-                processCharLiteral();
-                break;
+        alignas(inotify_event) char buffer[64 * 1024];
+        ssize_t size = ::read(m_fd, buffer, sizeof(buffer));
+        if (size <= 0)
+            return false;
 
-            case '/':               // Check for comments.
-                if (peek(1) == '*') {
-                    processCComment();  //  C comments don't need \ last on lines even if this expression is inside a non-raw literal.
-                    break;
-                }
-                else if (peek(1) == '/') {
-                    processCPPComment();  //  C++ comments support \ last on lines regardless of if the enclosing literal is raw or not.
-                    if (peek() == '\0')
-                        throw EarlyEnd("Input ends with a // comment inside a expression-field");
-                }
-                break;
+        for (ssize_t pos = 0; pos < size; ) {
+            auto event = reinterpret_cast<const inotify_event*>(buffer + pos);
+            if ((event->mask & IN_Q_OVERFLOW) != 0)
+                allChanged(changed);
+            else if (event->len > 0 && m_dirs.contains(event->wd))
+                fileChanged(m_dirs[event->wd] / event->name, changed);
+            pos += ssize_t(sizeof(inotify_event) + event->len);
+        }
+        return true;
+    }
 
-            default:
-                return;
+    int m_fd = -1;
+    std::map<int, std::filesystem::path> m_dirs;        // By watch descriptor.
+#else
+    bool watchDirectory(const std::filesystem::path&) { return true; }
+
+    // Sleep for a poll interval, or timeoutMs if shorter, then check the time stamps. Returns false on timeout.
+    bool readEvents(int timeoutMs, std::set<std::filesystem::path>& changed) {
+        int sleepMs = timeoutMs < 0 ? pollMs : std::min(timeoutMs, pollMs);
+        std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
+        size_t count = changed.size();
+        for (auto& [file, time] : m_files) {
+            std::error_code ec;
+            std::filesystem::file_time_type now = std::filesystem::last_write_time(file, ec);
+            if (!ec && now != time) {
+                time = now;
+                changed.insert(file);
             }
         }
+        return changed.size() != count || timeoutMs < 0 || timeoutMs > sleepMs;
     }
 
-    void processNestedParenthesis() {
-        static const std::string introducers = "([{";
-        static const std::string terminators = ")]}";
+    static constexpr int pollMs = 250;
+#endif
 
-        size_t intIx = introducers.find(peek());
-        assert(intIx != std::string::npos);     // Must be found.
+    std::map<std::filesystem::path, std::filesystem::file_time_type> m_files;      // Time stamps are only used when polling.
+};
 
-        xfer();
-        while (true) {
-            processNested();
-            char c = peek();
-            xfer();
-            if (c == terminators[intIx])
-                return;
-            if (terminators.find(c) != std::string::npos)
-                throw ParsingError(m_lineNo, std::format("Mismatched {}. A {} was found where a {} was expected.", introducers[intIx], c, terminators[intIx]));
+// Quote an argument for a Windows command line, as parsed by CommandLineToArgvW and the C runtime.
+std::string quoteArgument(std::string_view arg)
+{
+    if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string_view::npos)
+        return std::string(arg);
+
+    std::string ret = "\"";
+    size_t backslashes = 0;
+    for (char c : arg) {
+        if (c == '\\') {
+            backslashes++;
+            continue;
         }
+        ret.append(c == '"' ? 2 * backslashes + 1 : backslashes, '\\');     // Backslashes are only special before quotes.
+        backslashes = 0;
+        ret += c;
     }
+    ret.append(2 * backslashes, '\\');
+    return ret + '"';
+}
 
-    std::filesystem::path m_sourceFile;    // Path to file being compiled
-    std::string m_functionName;            // Name of function to wrap f-literals in.
-    bool m_lineDirectives;                 // True to output line directives. Set false in most unit tests.
+// True if compiler, the first argument of a compiler command, takes MSVC style options.
+bool isMsvcCompiler(const std::filesystem::path& compiler)
+{
+    std::string name = compiler.stem().string();
+    std::transform(name.begin(), name.end(), name.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c; });
+    return name == "cl" || name == "clang-cl";
+}
 
-    std::istream& m_inFile;         // Input stream
-    std::string m_inLine;           // Current line in input stream
-    int m_lineNo = 0;               // Line number (starts on 1)
-    const char* m_ptr;              // Pointer to current character.
+// True if path has the extension of a C or C++ source file.
+bool isSourceFile(std::string_view path)
+{
+    static const std::set<std::string_view> extensions = { ".c", ".C", ".cc", ".cp", ".cpp", ".cxx", ".c++", ".CPP", ".CC", ".CXX" };
+    return extensions.contains(std::filesystem::path(path).extension().string());
+}
 
-    std::ostream& m_outFile;        // Output stream.
-    std::string m_outLines;         // Current output lines. Except inside multi-line literals or comments this is always just one line
-};
+// True if arg, which starts with /, is a cl switch rather than an absolute path, which clang-cl accepts on POSIX systems. An
+// existing source file is a path. Otherwise switches with a value attached, which may end like a source file name, are recognized
+// by name, and other arguments are switches unless they have a source file extension.
+bool isClSwitch(std::string_view arg)
+{
+    static const std::string_view valueSwitches[] = { "Fo", "Fe", "Fd", "Fp", "Fa", "Fi", "FI", "FR", "Fr", "Fm", "Yc", "Yu", "I", "D", "U",
+                                                      "sourceDependencies", "external:I", "doc" };
+    std::error_code ec;
+    if (isSourceFile(arg) && std::filesystem::is_regular_file(std::filesystem::path(arg), ec))
+        return false;
+    if (std::any_of(std::begin(valueSwitches), std::end(valueSwitches), [&](std::string_view name) { return arg.substr(1).starts_with(name); }))
+        return true;
+    return !isSourceFile(arg);
+}
+
+// Index of the C or C++ source file in a compiler command, or 0 if there is not exactly one. The values of options taking a
+// separate argument are skipped. MSVC style options may start with / too, or name the source file using /Tp or /Tc.
+size_t findSourceFile(const std::vector<std::string>& command, bool msvc)
+{
+    static const std::set<std::string_view> valueOptions = { "-o", "-MF", "-MT", "-MQ", "-x", "-include", "-imacros", "-iquote", "-isystem",
+        "-idirafter", "-isysroot", "-I", "-D", "-U", "-Xclang", "-Xpreprocessor", "-Xlinker", "-Xassembler", "-target", "-arch", "--serialize-diagnostics" };
+
+    size_t ret = 0;
+    for (size_t ix = 1; ix < command.size(); ix++) {
+        std::string_view arg = command[ix];
+        bool option = arg.starts_with('-') || (msvc && arg.starts_with('/') && isClSwitch(arg));
+        if (msvc && option && arg.size() == 3 && (arg.substr(1) == "Tp" || arg.substr(1) == "Tc") && ix + 1 < command.size()) {
+            ret = ret == 0 ? ++ix : command.size();
+            continue;
+        }
+        if (msvc && option && arg.size() > 3 && (arg.substr(1, 2) == "Tp" || arg.substr(1, 2) == "Tc")) {
+            ret = ret == 0 ? ix : command.size();
+            continue;
+        }
+        if (option) {
+            ix += !msvc && valueOptions.contains(arg);
+            continue;
+        }
+        if (isSourceFile(arg))
+            ret = ret == 0 ? ix : command.size();
+    }
+    return ret < command.size() ? ret : 0;
+}
 
 
 struct TestSpec {
@@ -536,6 +481,11 @@ struct TestSpec {
     const char* truth = nullptr;
     bool expectOk = true;
     bool lineDirectives = false;
+    bool prefilter = false;         // Only affects buffer mode.
+    bool compactLines = false;
+    const char* functionName = "std::format";
+    bool skipDisabled = false;
+    const char* defines = "";       // Space separated -D and -U options, for skipDisabled.
 } tests[] = {
     // Test basic functionality
     { R"in()in" },
@@ -739,6 +689,34 @@ ve: {})xy", 5)))out" },
     { R"in(u9f"The number is: {3 * 5}")in",                                 R"out(u9std::format("The number is: {}", 3 * 5))out" },
     { R"in(LfR"xy(The number is: {3 * 5})xy")in",                           R"out(std::format(LR"xy(The number is: {})xy", 3 * 5))out" },
 
+    // Division is not a comment.
+    { R"in(f"{a / b}{(c / d)}")in",                                         R"out(std::format("{}{}", a / b, (c / d)))out" },
+
+    // Expressions of adjacent fields must not be taken as literal prefixes of each other.
+    { R"in(f"{f}{"s"} {R}{"t"}")in",                                       R"out(std::format("{}{} {}{}", f, "s", R, "t"))out" },
+    { R"in(f"{a}{f"{b}"}")in",                                              R"out(std::format("{}{}", a, std::format("{}", b)))out" },
+
+    // Test passing the field count, and the length of the static text, to the function.
+    { R"in(f"a {b} c")in",                                                  R"out(fn<1>("a {} c", b))out", true, false, false, false, "fn*" },
+    { R"in(f"a {b} c")in",                                                  R"out(fn<1, 4>("a {} c", b))out", true, false, false, false, "fn**" },
+    { R"in(f"{{{a:{b}.{c}}}}{d=}\n")in",                                   R"out(fn<4, 6>("{{{:{}.{}}}}d={}\n", a, b, c, d))out", true, false, false, false, "fn**" },
+    { R"in(u8fR"x({a}"{{)x")in",                                            R"out(fn<1, 2>(u8R"x({}"{{)x", a))out", true, false, false, false, "fn**" },
+    { R"in(x"{a}")in",                                                      R"out("{}", a)out", true, false, false, false, "fn**" },
+
+    // Adjacent literals are merged into one f/x literal, where braces of plain literals are text.
+    { R"in(f"a {b} " "c {{d}}" f"{e}")in",                                  R"out(std::format("a {} " "c {{{{d}}}}" "{}", b, e))out" },
+    { R"in(u8"x{" R"(}y)" f"{a}";)in",                                      R"out(std::format(u8"x{{" R"(}}y)" "{}", a);)out" },
+    { R"in(f"{a}" // c
+  "b\"" /* d */ R"-(e})-" x;)in",                                          R"out(std::format("{}" // c
+  "b\"" /* d */ R"-(e}})-", a) x;)out" },
+    { R"in(x"{a}"   "b")in",                                                R"out("{}"   "b", a)out" },
+    { R"in(f"a{b}" "cd{")in",                                               R"out(fn<1, 4>("a{}" "cd{{", b))out", true, false, false, false, "fn**" },
+    { R"in("a{" "b}"s "c" f"{d}"s)in",                                      R"out("a{" "b}"s std::format("c" "{}", d)s)out" },
+    { R"in(#define X f"{a}"
+"b")in",                                                                    R"out(#define X std::format("{}", a)
+"b")out" },
+    { R"in(f"{a}" x"{b}")in",                                               nullptr, false },
+
     // Test colon fill character
     { R"in(Lf"The number is: {3 * 5::<5}")in",                              R"out(std::format(L"The number is: {::<5}", 3 * 5))out" },
 
@@ -759,29 +737,167 @@ ve: {})xy", 5)))out" },
 std::format(L"The number is: {}"
 #line 1 "test"
                  , 3 * 5))out", true, true },
+
+    // Resynchronize the line number after a literal which spans lines after its last field.
+    { "f\"{a}\\\n\"; b",                                                   R"out(
+#line 1 "test"
+std::format("{}\
+"
+#line 1 "test"
+ , a)
+#line 2 "test"
+ ; b)out", true, true },
+
+    // Compact mode: Only #line directives where the line would be wrong, without padding.
+    { R"in(Lf"The number is: {3 * 5}")in",                                  R"out(
+#line 1 "test"
+std::format(L"The number is: {}", 3 * 5))out", true, true, false, true },
+    { "f\"{a}\\\n{b}\"; c\nd",                                              R"out(
+#line 1 "test"
+std::format("{}\
+{}"
+#line 1 "test"
+, a
+#line 2 "test"
+, b); c
+d)out", true, true, false, true },
+    { "x = fR\"(\n{a\n}\n)\";\ny",                                            R"out(
+#line 1 "test"
+x = std::format(R"(
+{}
+)"
+#line 2 "test"
+, a
+)
+#line 4 "test"
+;
+y)out", true, true, false, true },
+
+    // A field first on a line can't have its , right before it.
+    { "fR\"(\n{e})\"",                                                   R"out(
+#line 1 "test"
+std::format(R"(
+{})"
+#line 2 "test"
+, e))out", true, true },
+
+    // Test the prefilter, which must not change the output.
+    { R"in(xx = "f" 'x' F R"(x)" /* f */)in", nullptr, true, false, true },
+    { R"in(xx = "f" 'x' F R"(x)" /* f */)in", R"out(
+#line 1 "test"
+xx = "f" 'x' F R"(x)" /* f */)out", true, true, true },
+    { R"in(xx = F"{a}")in",                                                 R"out(xx = std::format("{}", a))out", true, false, true },
+    { R"in(xx = XR"(a{b})")in",                                             R"out(xx = R"(a{})", b)out", true, false, true },
+
+    // Test skipping of disabled #if groups, which are copied without being lexed.
+    { "#if 0\n\"unterminated\n#endif\nx = f\"{a}\";",                       "#if 0\n\"unterminated\n#endif\nx = std::format(\"{}\", a);", true, false, false, false, "std::format", true },
+    { "#if 0\nf\"{a}\"\n#endif",                                            nullptr, true, false, false, false, "std::format", true },
+    { "#if 1\nf\"{a}\"\n#else\nf\"{b}\n#endif",                               "#if 1\nstd::format(\"{}\", a)\n#else\nf\"{b}\n#endif", true, false, false, false, "std::format", true },
+    { "  #  if 0 // '\n#if 1\n#else\n#endif\n'\n#elif 1\nf\"{a}\"\n#else\n'\n#endif\n", "  #  if 0 // '\n#if 1\n#else\n#endif\n'\n#elif 1\nstd::format(\"{}\", a)\n#else\n'\n#endif\n", true, false, false, false, "std::format", true },
+    { "#if X\nf\"{a}\"\n#else\nf\"{b}\"\n#endif",                             "#if X\nstd::format(\"{}\", a)\n#else\nstd::format(\"{}\", b)\n#endif", true, false, false, false, "std::format", true },
+    { "#if X\n#elif 1\nf\"{a}\"\n#else\n'\n#endif",                          "#if X\n#elif 1\nstd::format(\"{}\", a)\n#else\n'\n#endif", true, false, false, false, "std::format", true },
+    { "#if 0 /* c */ || 1\nf\"{a}\"\n#endif",                                 "#if 0 /* c */ || 1\nstd::format(\"{}\", a)\n#endif", true, false, false, false, "std::format", true },
+    { "#if 0\n/*\n#endif\n*/ \"/*\" // /*\n'\n#endif\nf\"{a}\"",                "#if 0\n/*\n#endif\n*/ \"/*\" // /*\n'\n#endif\nstd::format(\"{}\", a)", true, false, false, false, "std::format", true },
+    { "#if 0 \\\n|| 1\nf\"{a}\"\n#endif",                                    "#if 0 \\\n|| 1\nstd::format(\"{}\", a)\n#endif", true, false, false, false, "std::format", true },
+    { "#if 0\nx \\\n#endif\n'\n#endif\nf\"{a}\"",                             "#if 0\nx \\\n#endif\n'\n#endif\nstd::format(\"{}\", a)", true, false, false, false, "std::format", true },
+    { "#if A >= 2 && !defined(B)\nf\"{a}\"\n#else\n'\n#endif\n#ifdef B\n'\n#elif defined C\nf\"{c}\"\n#endif\n#ifndef A\n'\n#endif",
+      "#if A >= 2 && !defined(B)\nstd::format(\"{}\", a)\n#else\n'\n#endif\n#ifdef B\n'\n#elif defined C\nstd::format(\"{}\", c)\n#endif\n#ifndef A\n'\n#endif",
+      true, false, false, false, "std::format", true, "-DA=0x2u -UB" },
+    { "#if A == 1 && B\n'\n#endif",                                          nullptr, true, false, false, false, "std::format", true, "-DA -UB" },
+    { "#undef A\n#if A\nf\"{a}\"\n#endif",                                    "#undef A\n#if A\nstd::format(\"{}\", a)\n#endif", true, false, false, false, "std::format", true, "-DA" },
+    { "#if 0\n'\n#endif\nf\"{a}\"",                                          R"out(
+#line 1 "test"
+#if 0
+'
+#endif
+std::format("{}"
+#line 4 "test"
+ , a))out", true, true, false, false, "std::format", true },
+    { "#if 0\n\"\n#endif",                                                   nullptr, false },
 };
 
 
-bool runOneTest(const TestSpec& test, int ix)
+void printDiagnostics(std::ostream& out, const std::filesystem::path& file, const std::vector<FxDiagnostic>& diagnostics)
+{
+    for (auto& diagnostic : diagnostics)
+        out << std::format("{}({},{}): error: {}\n", file.string(), diagnostic.line, diagnostic.column, diagnostic.message);
+}
+
+// #error directives to append to the output of a file with errors. The output is written anyway, as it is complete with the
+// text of the literals with errors as it is, but a build which considers it up to date must still fail when compiling it.
+std::string errorMarkers(const std::filesystem::path& file, const std::vector<FxDiagnostic>& diagnostics)
+{
+    std::string ret;
+    for (auto& diagnostic : diagnostics) {
+        std::string message;
+        for (char c : diagnostic.message) {
+            if (c == '"' || c == '\\')
+                message += '\\';
+            message += c;
+        }
+        ret += std::format("\n#line {} \"{}\"\n#error \"{}\"\n", diagnostic.line, file.string(), message);
+    }
+    return ret;
+}
+
+enum class TestMode { stream, buffer, streaming, chunked, sourceMap };
+
+// Run the tasks of extractFxChunked one by one.
+void runSerially(std::vector<std::function<void()>>& tasks)
+{
+    for (auto& task : tasks)
+        task();
+}
+
+bool runOneTest(const TestSpec& test, int ix, TestMode testMode)
 {
-    std::istringstream in(test.input);
-    std::ostringstream out;
-    FxExtractor extractor(out, in, "test", "std::format", test.lineDirectives);
+    FxOptions options{ .sourceFile = "test", .functionName = test.functionName, .lineDirectives = test.lineDirectives, .compactLines = test.compactLines,
+                       .prefilter = test.prefilter, .streaming = testMode == TestMode::streaming, .skipDisabled = test.skipDisabled,
+                       .sourceMap = testMode == TestMode::sourceMap };
+    std::istringstream defines(test.defines);
+    for (std::string define; defines >> define; )
+        (define.starts_with("-D") ? options.defines : options.undefines).push_back(define.substr(2));
+
+    std::string out;
+    FxResult result;
+    if (testMode == TestMode::buffer || testMode == TestMode::sourceMap)
+        result = extractFx(test.input, out, options);
+    else if (testMode == TestMode::chunked)
+        result = extractFxChunked(test.input, out, options, size_t(ix % 7 + 1), runSerially);      // Tiny parts to split the tests.
+    else {
+        std::istringstream in(test.input);
+        FxStringSink sink(out);
+        FxExtractor extractor(sink, in, options);
+        result.ok = extractor.process(result.diagnostics);
+        result.stats = extractor.stats();
+    }
+    printDiagnostics(std::cerr, options.sourceFile, result.diagnostics);
+    const char* modes[] = { "stream", "buffer", "streaming", "chunked", "source map" };
+    const char* mode = modes[int(testMode)];
 
     if (test.expectOk) {
-        if (!extractor.process()) {
-            std::cerr << std::format("ERROR in test {}: The error string above was unexpected when processing input:\n{}\n", ix, test.input);
+        if (!result.ok) {
+            std::cerr << std::format("ERROR in test {} ({} mode): The error string above was unexpected when processing input:\n{}\n", ix, mode, test.input);
             return false;
         }
         std::string truth = test.truth != nullptr ? test.truth : test.input;
-        if (out.str() != truth) {
-            std::cerr << std::format("ERROR in test {}: Extraction produced erroneous output:\n{}\nWhen expected output is:\n{}\nFor input:\n{}\n", ix, out.str(), truth, test.input);
+        if (out != truth) {
+            std::cerr << std::format("ERROR in test {} ({} mode): Extraction produced erroneous output:\n{}\nWhen expected output is:\n{}\nFor input:\n{}\n", ix, mode, out, truth, test.input);
+            return false;
+        }
+
+        std::string_view input = test.input;
+        auto lines = [](std::string_view text) { return size_t(std::count(text.begin(), text.end(), '\n')) + (text.empty() || text.back() == '\n' ? 0 : 1); };
+        const FxStats& stats = result.stats;
+        if (stats.bytesRead != input.size() || stats.linesRead != lines(input) || stats.bytesWritten != out.size() || stats.linesWritten != lines(out)) {
+            std::cerr << std::format("ERROR in test {} ({} mode): Wrong stats: {} bytes and {} lines read, {} bytes and {} lines written for input:\n{}\n", ix, mode,
+                                     stats.bytesRead, stats.linesRead, stats.bytesWritten, stats.linesWritten, test.input);
             return false;
         }
     }
     else {
-        if (extractor.process()) {
-            std::cerr << std::format("ERROR in test {}: The input below should have produced an error string.\n{}\nExtraction however produced output:\n{}\n", ix, test.input, out.str());
+        if (result.ok || result.diagnostics.empty()) {
+            std::cerr << std::format("ERROR in test {} ({} mode): The input below should have produced an error string.\n{}\nExtraction however produced output:\n{}\n", ix, mode, test.input, out);
             return false;
         }
     }
@@ -789,78 +905,1903 @@ bool runOneTest(const TestSpec& test, int ix)
     return true;
 }
 
-
-int test()
+// Check the literal and field counters, which the tests table doesn't cover.
+bool testStats()
 {
-    int ret = 0;
-    int total = 0;
-    for (auto& test : tests) {
-        if (!runOneTest(test, total))
-            ret++;
-        total++;
+    std::string out;
+    FxStats stats = extractFx("f\"{a=}{b:{c}}\" + x\"{d}\" + fR\"(\n{e})\" + R\"(f)\"", out).stats;
+    if (stats.fLiterals != 2 || stats.xLiterals != 1 || stats.rawLiterals != 2 || stats.fields != 4 || stats.nestedFields != 1 ||
+        stats.debugFields != 1 || stats.lineDirectives != 6) {
+        std::cerr << std::format("ERROR in stats test: Got {} f, {} x, {} raw literals, {} fields, {} nested, {} debug and {} #line\n", stats.fLiterals,
+                                 stats.xLiterals, stats.rawLiterals, stats.fields, stats.nestedFields, stats.debugFields, stats.lineDirectives);
+        return false;
     }
-   
-    std::cerr << ret << " tests of " << total << " failed." << std::endl;
-    return ret;
+
+    stats = extractFx("#if 0\n#if 1\n#endif\n#else\nf\"\"\n#endif\n#if 1\n#else\nx\n", out, { .skipDisabled = true }).stats;
+    if (stats.disabledLines != 3) {
+        std::cerr << std::format("ERROR in stats test: Got {} disabled lines\n", stats.disabledLines);
+        return false;
+    }
+    return true;
 }
 
-// Process stdin -> stdout, file -> stdout or file -> file.
-int main(int argc, char** argv)
+// Check that big comments and plain literals are passed through without being held in memory, in both buffer and stream mode,
+// with both short and long lines.
+bool testPassThrough()
 {
-    if (argc == 2 && strcmp(argv[1], "-h") == 0 || argc > 5) {
-        std::cerr << "Usage: extractfx [<inFile> [<outFile>]].\nIf no parameters are given reads from stdin, if no outFile is given writes to stdout.\nIf --test is the only parameter does a self test.\n";
-        return 0;
+    std::string body = "\n";
+    for (int i = 0; i < 20000; i++)
+        body += "  { \"key\": [1, 2, 3] },\n";
+    body += std::string(300000, 'y') + "\n";
+    std::string comment = "***" + std::string(300000, 'c') + "\n";
+    for (int i = 0; i < 20000; i++)
+        comment += " * comment line\n";
+    std::string input = "x = f\"{a}\";\nauto s = R\"json(" + body + ")json\", f\"{b}\"; /*" + comment + "*/ x = f\"{c}\"; // " + std::string(300000, '/');
+    std::string truth = "x = std::format(\"{}\", a);\nauto s = R\"json(" + body + ")json\", std::format(\"{}\", b); /*" + comment +
+        "*/ x = std::format(\"{}\", c); // " + std::string(300000, '/');
+
+    for (bool stream : { false, true }) {
+        std::string out;
+        FxResult result;
+        FxOptions options{ .lineDirectives = false };
+        if (stream) {
+            std::istringstream in(input);
+            FxStringSink sink(out);
+            FxExtractor extractor(sink, in, options);
+            result.ok = extractor.process(result.diagnostics);
+            result.stats = extractor.stats();
+        }
+        else
+            result = extractFx(input, out, options);
+        if (!result.ok || out != truth || result.stats.peakOutLines > 200000) {
+            std::cerr << std::format("ERROR in pass through test: {} mode gave {} output, holding back {} bytes\n", stream ? "stream" : "buffer",
+                                     out == truth ? "the right" : "wrong", result.stats.peakOutLines);
+            return false;
+        }
     }
-    if (argc == 2 && strcmp(argv[1], "--test") == 0) {
-        std::cerr << "Performing self test\nNote: Negative testing will produce some printout here. Actual errors start with 'ERROR'\n";
-        return test();
+    return true;
+}
+
+// Check that \0 characters in the input are passed like other characters rather than ending it, in all modes, and that they
+// don't affect the source map.
+bool testNul()
+{
+    using namespace std::string_literals;
+    std::string input = "int a = 1; // \0 nul \0" "12 3\0\nint b = f\"{x}\0\";\nchar c = '\0';\0\n"s;
+    std::string truth = "int a = 1; // \0 nul \0" "12 3\0\nint b = std::format(\"{}\0\", x);\nchar c = '\0';\0\n"s;
+    for (TestMode mode : { TestMode::stream, TestMode::buffer, TestMode::sourceMap }) {
+        std::string out;
+        FxOptions options{ .lineDirectives = false, .sourceMap = mode == TestMode::sourceMap };
+        FxResult result;
+        if (mode == TestMode::stream) {
+            std::istringstream in(input);
+            FxStringSink sink(out);
+            FxExtractor extractor(sink, in, options);
+            result.ok = extractor.process(result.diagnostics);
+        }
+        else
+            result = extractFx(input, out, options);
+        bool mapOk = std::ranges::all_of(result.sourceMap, [](const FxMapEntry& entry) { return entry.line <= 3; });
+        if (!result.ok || out != truth || !mapOk) {
+            std::cerr << std::format("ERROR in nul test: {} mode gave the wrong output\n", mode == TestMode::stream ? "stream" : mode == TestMode::buffer ? "buffer" : "source map");
+            return false;
+        }
     }
+    return true;
+}
 
-    std::istream* is = &std::cin;
-    std::ostream* os = &std::cout;
+// Check that quoted #includes are renamed by FxOptions::includeResolver, also in input the prefilter would copy verbatim.
+bool testIncludes()
+{
+    std::string out;
+    FxOptions options{ .lineDirectives = false };
+    options.includeResolver = [](std::string_view name) { return name == "a.h" ? std::string("mirror/a.h") : std::string(); };
+    extractFx("#include \"a.h\"\n # include \"b.h\" // a.h\n#include <a.h>\n#define X \\\n#include \"a.h\"\n#include\"a.h\"", out, options);
+    const char* truth = "#include \"mirror/a.h\"\n # include \"b.h\" // a.h\n#include <a.h>\n#define X \\\n#include \"a.h\"\n#include\"mirror/a.h\"";
+    if (out != truth) {
+        std::cerr << std::format("ERROR in include test: Got:\n{}\nWhen expected output is:\n{}\n", out, truth);
+        return false;
+    }
+    return true;
+}
 
-    std::string functionName = "std::format";
+// Check that deeply nested brackets and ?: don't overflow the stack, and that f/x literals nested deeper than
+// FxOptions::maxNesting give an error rather than doing so.
+bool testNesting()
+{
+    const int depth = 100000;
+    std::string input = "f\"{" + std::string(depth, '(') + "a" + std::string(depth, ')') + ":{" + std::string(depth, '[') + std::string(depth, ']') + "}}\"\n";
+    input += "f\"{a ? b ? c : d : e:4}\" + f\"{a" + std::string(depth, '?') + std::string(depth, ':') + "}\"";
+    std::string out;
+    FxResult result = extractFx(input, out);
+    if (!result.ok) {
+        std::cerr << std::format("ERROR in nesting test: Deeply nested brackets and ternaries gave: {}\n", result.diagnostics[0].message);
+        return false;
+    }
 
-    std::filesystem::path inputPath  = "<stdin>";
+    auto nested = [](int depth) {
+        std::string ret = "x";
+        for (int i = 0; i < depth; i++)
+            ret = "f\"{" + ret + "}\"";
+        return ret;
+    };
+    result = extractFx(nested(10), out, { .maxNesting = 10 });
+    if (!result.ok) {
+        std::cerr << std::format("ERROR in nesting test: f-literals nested 10 deep gave: {}\n", result.diagnostics[0].message);
+        return false;
+    }
+    result = extractFx(nested(10000), out);
+    if (result.ok || result.diagnostics[0].message != "f/x literals are nested more than 256 deep.") {
+        std::cerr << "ERROR in nesting test: f-literals nested too deep didn't give the expected error\n";
+        return false;
+    }
+    return true;
+}
 
-    if (argc > 1) {
-        int argn = 1;
-        if (std::strncmp(argv[1], "--name", 6) == 0) {
-            argn++;
-            if (argv[1][6] == '=' || argv[1][6] == ':') {
-                functionName = argv[1] + 7;
-            }
-            else if (argc < 3) {
-                std::cout << "--name must be followed by a function name to surround f literals with. Default is std::format()\n.";
-                return 1;
+// Check that lexing resynchronizes after errors so that all of them are reported, up to FxOptions::maxErrors, that the text of
+// literals dropped at errors is output as it is, and that the errors are marked at the end of the output.
+bool testRecovery()
+{
+    std::string input = "void g() { int before = 1; auto s = f\"{call(a, b]}\"; int after = 2; }\n"
+                        "int keep = g(f\"{x:{y:z}}\");\n"
+                        "a = f\"{x\";\n"
+                        "b = f\"{y}\";\n"
+                        "c = f\"}\";\n"
+                        "d = fR\"(\n{f\"{q\"}\n)\" + f\"{w}\";\n"
+                        "e = f\"{v}\";\n";
+    std::string truth = "void g() { int before = 1; auto s = f\"{call(a, b]}\"; int after = 2; }\n"
+                        "int keep = g(f\"{x:{y:z}}\");\n"
+                        "a = f\"{x\";\n"
+                        "b = std::format(\"{}\", y);\n"
+                        "c = f\"}\";\n"
+                        "d = fR\"(\n{f\"{q\"}\n)\" + std::format(\"{}\", w);\n"
+                        "e = std::format(\"{}\", v);\n";
+    std::vector<std::pair<int, int>> truthPositions = { { 1, 50 }, { 2, 21 }, { 3, 11 }, { 5, 8 }, { 7, 8 } };
+
+    // The last error to report stops processing, and the rest of the input is output as it is. With maxErrors 2 that is all of it.
+    std::string stoppedTruth = truth.substr(0, truth.find("c = ")) + input.substr(input.find("c = "));
+
+    for (bool stream : { false, true }) {
+        for (int maxErrors : { 20, 4, 2 }) {
+            std::string out;
+            FxOptions options{ .lineDirectives = false, .maxErrors = maxErrors };
+            FxResult result;
+            if (stream) {
+                std::istringstream in(input);
+                FxStringSink sink(out);
+                FxExtractor extractor(sink, in, options);
+                result.ok = extractor.process(result.diagnostics);
             }
-            else {
-                functionName = argv[2];
-                argn++;
+            else
+                result = extractFx(input, out, options);
+
+            std::vector<std::pair<int, int>> positions;
+            for (auto& diagnostic : result.diagnostics)
+                positions.emplace_back(diagnostic.line, diagnostic.column);
+            size_t count = std::min(truthPositions.size(), size_t(maxErrors));
+            std::string_view expected = maxErrors == 20 ? truth : maxErrors == 4 ? stoppedTruth : input;
+            if (result.ok || positions != std::vector(truthPositions.begin(), truthPositions.begin() + ptrdiff_t(count)) || out != expected) {
+                std::cerr << std::format("ERROR in recovery test: In {} mode with maxErrors {} got:\n{}\nWhen expected output is:\n{}\n", stream ? "stream" : "buffer",
+                                         maxErrors, out, expected);
+                return false;
             }
         }
+    }
 
-        if (argc > argn) {
-            inputPath = argv[argn++];
-            static std::ifstream inFile(inputPath);
-            if (!inFile) {
-                std::cerr << "Could not open input file " << argv[1];
-                return 1;
-            }
-            is = &inFile;
-        }
+    std::string markers = errorMarkers("a.cpp", { { 3, 8, "Missing \"" } });
+    if (markers != "\n#line 3 \"a.cpp\"\n#error \"Missing \\\"\"\n") {
+        std::cerr << "ERROR in recovery test: Errors were marked as " << markers << "\n";
+        return false;
+    }
+    return true;
+}
 
-        if (argc > argn) {
-            static std::ofstream outFile(argv[argn]);
-            if (!outFile) {
-                std::cerr << "Could not open output file " << argv[2];
-                return 1;
-            }
-            os = &outFile;
+// Split text with fxSplitFields() into a call like extract_fx gives for f"text" with --name F**, or return the error.
+std::string splitFields(std::string_view text)
+{
+    std::string format, names;
+    size_t count = 0;
+    const char* error = fxSplitFields(text, [&](std::string_view part) { format += part; }, [&](std::string_view name) {
+        names += ", ";
+        names += name;
+        count++;
+    });
+    if (error != nullptr)
+        return error;
+
+    return std::format("F<{}, {}>(\"{}\"{})", count, fxStaticLength(format), format, names);
+}
+
+// Check that the compile time splitting of simple fields used by format_literal.h gives the same result as extract_fx.
+bool testSimpleFields()
+{
+    static_assert([] {
+        std::array<char, 8> format{};
+        size_t length = 0, count = 0;
+        fxSplitFields("a{b:{c}}", [&](std::string_view part) { for (char c : part) format[length++] = c; }, [&](std::string_view) { count++; });
+        return std::string_view(format.data(), length) == "a{:{}}" && count == 2 && fxStaticLength("a{:{}}") == 1;
+    }());
+
+    for (std::string_view text : { "a{b}c", "{x= }{ns::y:>{w}.{p}} {{}} }}{{", "{a.b->c=:4}{d}", "" }) {
+        std::string out;
+        std::string split = splitFields(text);
+        FxResult result = extractFx(std::format("f\"{}\"", text), out, { .functionName = "F**", .lineDirectives = false });
+        if (!result.ok || split != out) {
+            std::cerr << std::format("ERROR in simple field test: {} split to:\n{}\nWhen extract_fx gave:\n{}\n", text, split, out);
+            return false;
         }
     }
 
-    FxExtractor extractor(*os, *is, inputPath, functionName, true);
-    return extractor.process() ? 0 : 1;
+    for (std::string_view text : { "{a+b}", "{a}}", "{1}", "{a:{b+1}}", "{a" }) {
+        if (splitFields(text).starts_with("F<")) {
+            std::cerr << std::format("ERROR in simple field test: {} should not be a simple field\n", text);
+            return false;
+        }
+    }
+    return true;
 }
 
+// Check that random edits of FxIncrementalExtractor give the same output, source map and errors as extracting the edited source
+// from scratch, and that the changes reported span the difference to the output before.
+bool testIncremental()
+{
+    const char* pieces[] = { "x = f\"{a}\";\n", "y = R\"(\n;\n{\n)\";\n", "/*\n;\n*/\n", "#define M \\\n  f\"{b}\" \\\n  ;\n", "z = fR\"x(\n{c};\n)x\";\n",
+                             "w = f\"{d:{e}}\"\n  \"more\";\n", "\"p{\" /* c\n*/\n", "  f\"{q}\"\n", "// c \\\n;\n", "v = 1;\r\n", "\"", "{", "\n" };
+    uint32_t seed = 7;
+    auto random = [&seed](size_t n) {
+        seed = seed * 1103515245 + 12345;
+        return size_t((seed >> 16) % n);
+    };
+
+    std::vector<size_t> pieceSizes;         // The pieces of the source, which start at top level.
+    std::string source;
+    for (int i = 0; i < 100; i++) {
+        const char* piece = pieces[random(std::size(pieces) - 3)];
+        source += piece;
+        pieceSizes.push_back(strlen(piece));
+    }
+
+    for (FxOptions options : { FxOptions{}, FxOptions{ .sourceMap = true }, FxOptions{ .compactLines = true, .skipDisabled = true } }) {
+        options.prefilter = false;
+        FxIncrementalExtractor incremental(source, options, 64);
+        std::vector<size_t> sizes = pieceSizes;
+        bool undo = false;          // Undo the previous edit, which was anywhere and may have made the source erroneous.
+        size_t offset = 0;
+        size_t length = 0;
+        std::string text;
+        std::string removed;
+        for (int i = 0; i < 400; i++) {
+            std::string before = incremental.output();
+            const std::string& current = incremental.source();
+            if (undo) {
+                length = text.size();
+                text = removed;
+                undo = false;
+            }
+            else if (random(2) == 0) {
+                // Insert or remove a piece, which keeps the source free of errors.
+                size_t ix = random(sizes.size() + 1);
+                offset = std::accumulate(sizes.begin(), sizes.begin() + ptrdiff_t(ix), size_t(0));
+                if (ix < sizes.size() && random(2) == 0) {
+                    length = sizes[ix];
+                    text.clear();
+                    sizes.erase(sizes.begin() + ptrdiff_t(ix));
+                }
+                else {
+                    length = 0;
+                    text = pieces[random(std::size(pieces) - 3)];
+                    sizes.insert(sizes.begin() + ptrdiff_t(ix), text.size());
+                }
+            }
+            else {
+                offset = random(current.size() + 1);
+                length = std::min(random(8), current.size() - offset);
+                text = pieces[random(std::size(pieces))];
+                undo = true;
+            }
+            removed = current.substr(offset, length);
+            FxIncrementalExtractor::Change change = incremental.edit(offset, length, text);
+
+            std::string truth;
+            FxResult result = extractFx(incremental.source(), truth, options);
+            const std::string& out = incremental.output();
+            std::string spliced = before;
+            spliced.replace(change.outputBegin, change.removedOutput, out, change.outputBegin, change.outputEnd - change.outputBegin);
+            bool sameMap = result.sourceMap.size() == incremental.sourceMap().size() &&
+                std::equal(result.sourceMap.begin(), result.sourceMap.end(), incremental.sourceMap().begin(), [](auto& lhs, auto& rhs) {
+                    return lhs.offset == rhs.offset && lhs.outLine == rhs.outLine && lhs.outColumn == rhs.outColumn && lhs.line == rhs.line && lhs.column == rhs.column; });
+            bool sameDiagnostics = result.diagnostics.size() == incremental.diagnostics().size() &&
+                std::equal(result.diagnostics.begin(), result.diagnostics.end(), incremental.diagnostics().begin(), [](auto& lhs, auto& rhs) {
+                    return lhs.line == rhs.line && lhs.column == rhs.column && lhs.message == rhs.message; });
+            if (result.ok != incremental.ok() || !sameDiagnostics || (result.ok && (out != truth || !sameMap || spliced != out))) {
+                std::cerr << std::format("ERROR in incremental test: Edit {} gave a different result than extracting the source:\n{}\n", i, incremental.source());
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Check that a source map translates output positions of expression-fields, also in macros, and of the text after literals to
+// their input positions, and that the output is the same as without #line directives.
+bool testSourceMap()
+{
+    const char* input = "int a = f\"x{alpha}y\" + tail1;\nauto s = f\"{beta +\n gamma}\" /*tail2*/;\n#define M f\"{delta:{eps}}\" + 1\nlast;";
+    std::string out;
+    FxResult result = extractFx(input, out, { .sourceFile = "in.cpp", .sourceMap = true });
+    std::string truth;
+    extractFx(input, truth, { .lineDirectives = false });
+    if (out != truth) {
+        std::cerr << std::format("ERROR in source map test: Got:\n{}\nWhen expected output is:\n{}\n", out, truth);
+        return false;
+    }
+
+    std::string data = FxSourceMap::serialize("in.cpp", result.sourceMap);
+    FxSourceMap map;
+    if (!map.load(data) || map.sourceFile() != "in.cpp" || map.size() != result.sourceMap.size() || map.load(std::string_view(data).substr(1))) {
+        std::cerr << "ERROR in source map test: The serialized map could not be loaded\n";
+        return false;
+    }
+
+    // Line and column starting at 1 of the only occurrence of token in text.
+    auto position = [](std::string_view text, std::string_view token) {
+        size_t offset = text.find(token);
+        size_t lineStart = text.rfind('\n', offset) + 1;      // 0 if there is no \n before.
+        return std::pair<int, int>(int(std::count(text.begin(), text.begin() + offset, '\n')) + 1, int(offset - lineStart) + 1);
+    };
+    for (const char* token : { "int", "alpha", "tail1", "beta", "gamma", "tail2", "delta", "eps", "last" }) {
+        auto [line, column] = position(out, token);
+        std::pair<int, int> translated = map.translate(line, column);
+        if (translated != position(input, token)) {
+            std::cerr << std::format("ERROR in source map test: {} at {}:{} was translated to {}:{}\n", token, line, column, translated.first, translated.second);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that chunked extraction of a longer input with constructs spanning lines gives the same result as serial extraction, for
+// parts starting both inside and outside literals and comments.
+bool testChunked()
+{
+    const char* pieces[] = { "x = f\"{a}\";\n", "y = R\"(\n;\n{\n)\";\n", "/*\n;\n*/\n", "#define M \\\n  f\"{b}\" \\\n  ;\n", "z = fR\"x(\n{c};\n)x\";\n",
+                             "{\n", "}\n", "w = f\"{d:{e}}\"\n  \"more\";\n", "\"p{\" /* c\n*/\n", "  f\"{q}\"\n", "// c \\\n;\n", "v = 1;\r\n" };
+    std::string input;
+    uint32_t seed = 1;
+    for (int i = 0; i < 300; i++) {
+        seed = seed * 1103515245 + 12345;
+        input += pieces[(seed >> 16) % std::size(pieces)];
+    }
+
+    for (const char* end : { "", "q = f\"{x\";\n" }) {        // Without and with an error at the end.
+        std::string source = input + end;
+        std::string truth;
+        FxResult serial = extractFx(source, truth);
+        for (size_t chunkSize : { 1, 13, 100, 1000 }) {
+            std::string out;
+            FxResult result = extractFxChunked(source, out, {}, chunkSize, runSerially);
+            bool sameDiagnostics = result.diagnostics.size() == serial.diagnostics.size() &&
+                std::equal(result.diagnostics.begin(), result.diagnostics.end(), serial.diagnostics.begin(), [](auto& lhs, auto& rhs) {
+                    return lhs.line == rhs.line && lhs.column == rhs.column && lhs.message == rhs.message; });
+            const FxStats& s = result.stats;
+            const FxStats& t = serial.stats;
+            if (out != truth || result.ok != serial.ok || !sameDiagnostics || s.linesRead != t.linesRead || s.bytesWritten != t.bytesWritten ||
+                s.linesWritten != t.linesWritten || s.fLiterals != t.fLiterals || s.lineDirectives != t.lineDirectives || s.bytesRead != t.bytesRead) {
+                std::cerr << std::format("ERROR in chunked test: Parts of {} bytes gave a different result than serial extraction\n", chunkSize);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Check that FileWatcher reports a watched file saved in place and by renaming a new file over it, but not other files. This
+// depends on the file system and on the timing of its events, so it is run separately from test() using --test-watcher.
+bool testWatcher()
+{
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / std::format("extract_fx_watch_{}", std::chrono::steady_clock::now().time_since_epoch().count());
+    std::filesystem::create_directories(dir);
+    std::filesystem::path a = std::filesystem::absolute(dir / "a.cpp").lexically_normal();
+    std::filesystem::path b = std::filesystem::absolute(dir / "b.cpp").lexically_normal();
+    auto save = [](const std::filesystem::path& path, std::string_view contents) {
+        std::ofstream(path, std::ios::binary) << contents;
+    };
+    save(a, "a");
+    save(b, "b");
+
+    bool ok;
+    {
+        FileWatcher watcher;
+        ok = watcher.watch(a) && watcher.watch(b);
+        save(a, "a2");
+        save(dir / "other.cpp", "c");
+        ok = ok && watcher.wait(20, 5000) == std::set{ a };
+
+        save(dir / "b.tmp", "b2");
+        std::filesystem::rename(dir / "b.tmp", b);
+        ok = ok && watcher.wait(20, 5000) == std::set{ b };
+    }
+    std::filesystem::remove_all(dir);
+    if (!ok)
+        std::cerr << "ERROR in watcher test: Changed files were not reported as expected\n";
+    return ok;
+}
+
+// Check that the source file is found in compiler commands, skipping option values, and that arguments are quoted for Windows.
+bool testLaunch()
+{
+    struct { std::vector<std::string> command; size_t source; } commands[] = {
+        { { "g++", "-DX", "-I", "inc.cpp", "-MD", "-MT", "a.o", "-MF", "a.o.d", "-o", "a.cpp", "-c", "src/a.cpp" }, 12 },
+        { { "clang++", "-x", "c++", "-c", "/src/a.cxx" }, 4 },
+        { { "g++", "a.o", "b.o", "-o", "prog" }, 0 },
+        { { "g++", "-c", "a.cpp", "b.cpp" }, 0 },
+        { { "cl.exe", "/nologo", "/TP", "/Foa.obj", "/c", "C:\\src\\a.cpp" }, 5 },
+        { { "clang-cl", "/c", "/Tp", "a.inc" }, 3 },
+        { { "CL", "/c", "-Tpa.inc" }, 2 },
+        { { "clang-cl", "/c", "/abs/path/a.cpp" }, 2 },
+        { { "clang-cl", "/c", "/Fa/out/a.cpp", "/I/inc", "/DX", "a.cpp" }, 5 },
+    };
+    bool ok = true;
+    for (auto& test : commands) {
+        size_t source = findSourceFile(test.command, isMsvcCompiler(test.command[0]));
+        if (source != test.source) {
+            std::cerr << std::format("ERROR in launch test: Found argument {} instead of {} as the source of {}\n", source, test.source, test.command[0]);
+            ok = false;
+        }
+    }
+
+    std::string quoted = quoteArgument("a b") + " " + quoteArgument("x") + " " + quoteArgument("c:\\d e\\") + " " + quoteArgument("q\\\"") + " " + quoteArgument("");
+    if (quoted != R"("a b" x "c:\d e\\" "q\\\"" "")") {
+        std::cerr << "ERROR in launch test: Arguments quoted as " << quoted << "\n";
+        ok = false;
+    }
+    return ok;
+}
+
+int test()
+{
+    int ret = 0;
+    int total = 0;
+    for (auto& test : tests) {
+        if (!runOneTest(test, total, TestMode::stream) || !runOneTest(test, total, TestMode::buffer) || !runOneTest(test, total, TestMode::streaming) ||
+            !runOneTest(test, total, TestMode::chunked) || (!test.lineDirectives && !runOneTest(test, total, TestMode::sourceMap)))
+            ret++;
+        total++;
+    }
+
+    if (!testStats())
+        ret++;
+    if (!testPassThrough())
+        ret++;
+    if (!testNul())
+        ret++;
+    if (!testIncludes())
+        ret++;
+    if (!testChunked())
+        ret++;
+    if (!testSourceMap())
+        ret++;
+    if (!testIncremental())
+        ret++;
+    if (!testNesting())
+        ret++;
+    if (!testRecovery())
+        ret++;
+    if (!testSimpleFields())
+        ret++;
+    if (!testLaunch())
+        ret++;
+    total += 11;
+   
+    std::cerr << ret << " tests of " << total << " failed." << std::endl;
+    return ret;
+}
+
+// An input file and the file to write the extracted result to.
+struct FileJob {
+    std::filesystem::path input;
+    std::filesystem::path output;
+};
+
+// Sink writing to a file descriptor through a large buffer, used for stdout and output files. Data at least as large as the buffer
+// is written together with what is buffered in one writev call, without being copied. A failed write is reported by close().
+class FxFdSink : public FxSink {
+public:
+    // Write to fd, which is not closed.
+    explicit FxFdSink(int fd) : m_fd(fd) {}
+
+    // Create or truncate the file at path. Check isOpen() for success.
+    explicit FxFdSink(const std::filesystem::path& path) : m_owned(true) {
+#ifdef _WIN32
+        m_fd = _wopen(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+    }
+
+    ~FxFdSink() override { close(); }
+
+    bool isOpen() const { return m_fd >= 0; }
+
+    void write(std::string_view data) override {
+        if (m_buffer.size() + data.size() <= bufferSize) {
+            m_buffer.append(data);
+            return;
+        }
+        if (data.size() < bufferSize) {
+            flush();
+            m_buffer.append(data);
+            return;
+        }
+        writeAll(m_buffer, data);
+        m_buffer.clear();
+    }
+
+    void flush() override {
+        writeAll(m_buffer, {});
+        m_buffer.clear();
+    }
+
+    // Flush, and close the file if opened by path. Returns false if anything could not be written.
+    bool close() {
+        if (m_fd < 0)
+            return !m_failed;
+
+        flush();
+        if (m_owned) {
+#ifdef _WIN32
+            m_failed = _close(m_fd) != 0 || m_failed;
+#else
+            m_failed = ::close(m_fd) != 0 || m_failed;
+#endif
+        }
+        m_fd = -1;
+        return !m_failed;
+    }
+
+private:
+    // Write first and then second, retrying after partial writes.
+    void writeAll(std::string_view first, std::string_view second) {
+        while (!m_failed && m_fd >= 0 && first.size() + second.size() != 0) {
+#ifdef _WIN32
+            std::string_view& part = first.empty() ? second : first;
+            int written = _write(m_fd, part.data(), unsigned(std::min<size_t>(part.size(), 1 << 30)));
+#else
+            iovec parts[2] = { { const_cast<char*>(first.data()), first.size() }, { const_cast<char*>(second.data()), second.size() } };
+            ssize_t written = ::writev(m_fd, parts, 2);
+            if (written < 0 && errno == EINTR)
+                continue;
+#endif
+            if (written <= 0) {
+                m_failed = true;
+                return;
+            }
+
+            size_t done = std::min(size_t(written), first.size());
+            first.remove_prefix(done);
+            second.remove_prefix(size_t(written) - done);
+        }
+    }
+
+    static constexpr size_t bufferSize = 256 * 1024;
+
+    int m_fd = -1;
+    bool m_owned = false;
+    bool m_failed = false;
+    std::string m_buffer;
+};
+
+// Write contents to path unless the file already has exactly these contents. Leaving the file untouched keeps its time stamp so
+// that build systems don't recompile it.
+bool writeIfChanged(const std::filesystem::path& path, std::string_view contents, std::ostream& errors)
+{
+    {
+        MappedFile existing(path);
+        if (existing.isOpen() && existing.view() == contents)
+            return true;
+    }
+
+    std::error_code ec;
+    if (path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path(), ec);
+
+    // Binary as the input is mapped as is, including any \r characters.
+    FxFdSink outFile(path);
+    if (outFile.isOpen())
+        outFile.write(contents);
+    if (!outFile.isOpen() || !outFile.close()) {
+        errors << "Could not write output file " << path.string() << "\n";
+        return false;
+    }
+    return true;
+}
+
+// The source map written next to output with --source-map.
+std::filesystem::path sourceMapPath(const std::filesystem::path& output)
+{
+    return std::filesystem::path(output) += ".fxmap";
+}
+
+// Write the source map of the extraction of sourceFile next to output, if it was collected.
+bool writeSourceMap(const std::filesystem::path& output, const FxOptions& options, const FxResult& result, std::ostream& errors)
+{
+    if (!options.sourceMap)
+        return true;
+
+    return writeIfChanged(sourceMapPath(output), FxSourceMap::serialize(options.sourceFile.string(), result.sourceMap), errors);
+}
+
+// 64 bit FNV-1a hash, used for cache keys.
+uint64_t hashBytes(std::string_view bytes, uint64_t hash = 14695981039346656037ull)
+{
+    for (char c : bytes)
+        hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+    return hash;
+}
+
+// Optional on disk cache of extraction results. The key covers everything that affects the output: The input contents and path,
+// the tool version and the options.
+class ResultCache {
+public:
+    explicit ResultCache(std::filesystem::path dir) : m_dir(std::move(dir)) {}
+
+    bool enabled() const { return !m_dir.empty(); }
+
+    std::filesystem::path entryPath(std::string_view input, const FxOptions& options) const {
+        uint64_t hash = hashBytes(input);
+        hash = hashBytes(extractFxVersion, hash);
+        hash = hashBytes(options.sourceFile.string(), hash);
+        hash = hashBytes(options.functionName, hash);
+        hash = hashBytes(options.lineDirectives ? options.compactLines ? "2" : "1" : "0", hash);
+        if (options.skipDisabled) {
+            hash = hashBytes("skip", hash);
+            for (auto& define : options.defines)
+                hash = hashBytes("\nD" + define, hash);
+            for (auto& undefine : options.undefines)
+                hash = hashBytes("\nU" + undefine, hash);
+        }
+        if (options.maxNesting != FxOptions().maxNesting)
+            hash = hashBytes(std::format("nest{}", options.maxNesting), hash);
+        return m_dir / std::format("{:016x}.fx", hash);
+    }
+
+    bool find(const std::filesystem::path& entry, std::string& contents) const {
+        MappedFile file(entry);
+        if (!file.isOpen())
+            return false;
+
+        contents = file.view();
+        return true;
+    }
+
+    // Store by writing a temporary file and renaming it so that concurrent readers never see a partial entry.
+    void store(const std::filesystem::path& entry, std::string_view contents) const {
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+        std::filesystem::path temp = entry;
+        temp += std::format(".{}.tmp", std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream out(temp, std::ios::binary);
+            if (!out.write(contents.data(), contents.size()))
+                return;
+        }
+        std::filesystem::rename(temp, entry, ec);
+        if (ec)
+            std::filesystem::remove(temp, ec);
+    }
+
+private:
+    std::filesystem::path m_dir;        // Empty if the cache is disabled.
+};
+
+// Collects the stats of each file for --stats, and prints them with the aggregate as text or JSON when done. Thread safe.
+class StatsReport {
+public:
+    enum class Format { none, text, json };
+
+    explicit StatsReport(Format format) : m_format(format) {}
+
+    bool enabled() const { return m_format != Format::none; }
+
+    void add(const std::filesystem::path& file, const FxStats& stats, bool cached) {
+        if (!enabled())
+            return;
+
+        std::lock_guard lock(m_mutex);
+        m_files.push_back({ file.string(), stats, cached });
+        m_total += stats;
+    }
+
+    void print(std::ostream& out) const {
+        if (m_format == Format::json) {
+            out << "{\"files\": [";
+            for (size_t i = 0; i < m_files.size(); i++)
+                out << (i == 0 ? "\n  " : ",\n  ") << std::format("{{\"file\": \"{}\", \"cached\": {}, {}}}", jsonEscape(m_files[i].name), m_files[i].cached, json(m_files[i].stats));
+            out << std::format("\n],\n\"total\": {{\"files\": {}, {}}}\n}}\n", m_files.size(), json(m_total));
+        }
+        else if (m_format == Format::text) {
+            for (auto& file : m_files)
+                out << file.name << (file.cached ? " (cached)" : "") << ": " << text(file.stats) << "\n";
+            if (m_files.size() > 1)
+                out << "Total for " << m_files.size() << " files: " << text(m_total) << "\n";
+        }
+    }
+
+private:
+    static std::string json(const FxStats& s) {
+        return std::format("\"bytesRead\": {}, \"linesRead\": {}, \"bytesWritten\": {}, \"linesWritten\": {}, \"fLiterals\": {}, \"xLiterals\": {}, "
+                           "\"rawLiterals\": {}, \"fields\": {}, \"nestedFields\": {}, \"debugFields\": {}, \"lineDirectives\": {}, "
+                           "\"disabledLines\": {}, \"peakOutLines\": {}, \"ioSeconds\": {:.6f}, \"lexSeconds\": {:.6f}", s.bytesRead, s.linesRead, s.bytesWritten,
+                           s.linesWritten, s.fLiterals, s.xLiterals, s.rawLiterals, s.fields, s.nestedFields, s.debugFields, s.lineDirectives, s.disabledLines, s.peakOutLines,
+                           s.ioSeconds, s.lexSeconds);
+    }
+
+    static std::string text(const FxStats& s) {
+        return std::format("read {} bytes, {} lines; wrote {} bytes, {} lines; {} f, {} x, {} raw literals; {} fields ({} nested, {} debug); "
+                           "{} #line; {} disabled lines; peak pending output {} bytes; I/O {:.3f} ms, lexing {:.3f} ms", s.bytesRead, s.linesRead,
+                           s.bytesWritten, s.linesWritten, s.fLiterals, s.xLiterals, s.rawLiterals, s.fields, s.nestedFields, s.debugFields,
+                           s.lineDirectives, s.disabledLines, s.peakOutLines, s.ioSeconds * 1000, s.lexSeconds * 1000);
+    }
+
+    static std::string jsonEscape(std::string_view str) {
+        std::string ret;
+        for (char c : str) {
+            if (c == '"' || c == '\\')
+                ret += '\\';
+            if (uint8_t(c) < 0x20)
+                ret += std::format("\\u{:04x}", int(c));
+            else
+                ret += c;
+        }
+        return ret;
+    }
+
+    struct FileStats {
+        std::string name;
+        FxStats stats;
+        bool cached;
+    };
+
+    Format m_format;
+    std::mutex m_mutex;
+    std::vector<FileStats> m_files;
+    FxStats m_total;
+};
+
+// Seconds since start, for the stats.
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Extracts the headers included by the files extracted with --follow-includes. Each quoted #include found next to the including
+// file or in the -I paths is extracted to a mirror of its absolute path below the mirror directory, and the #include is changed to
+// name the mirrored file. Each header is extracted once per process even if included by several files, batch jobs or server
+// requests, unless it changes on disk. The headers each header includes are kept to be able to list all headers a file depends on.
+// Thread safe.
+class HeaderCache {
+public:
+    HeaderCache(const std::filesystem::path& mirrorDir, std::vector<std::filesystem::path> includePaths) : m_includePaths(std::move(includePaths)) {
+        if (!mirrorDir.empty())
+            m_mirrorDir = std::filesystem::absolute(mirrorDir).lexically_normal();
+    }
+
+    bool enabled() const { return !m_mirrorDir.empty(); }
+
+    // Make the extraction with options follow includes relative to options.sourceFile, adding the headers found to includes.
+    void followIncludes(FxOptions& options, std::vector<std::filesystem::path>& includes) const {
+        options.includeResolver = [this, dir = options.sourceFile.parent_path(), &includes](std::string_view name) -> std::string {
+            std::filesystem::path header = find(name, dir);
+            if (header.empty())
+                return {};          // Left to the compiler, it may for instance be generated.
+
+            if (std::find(includes.begin(), includes.end(), header) == includes.end())
+                includes.push_back(header);
+            return mirrorPath(header).generic_string();
+        };
+    }
+
+    // Extract the headers in includes unless already done, and those they include recursively, which are added to includes. Returns
+    // false if any of them failed. Error messages are written to errors when a header is extracted, not each time it is included.
+    bool extractHeaders(std::vector<std::filesystem::path>& includes, const FxOptions& options, StatsReport& stats, std::ostream& errors) {
+        bool ok = true;
+        for (size_t i = 0; i < includes.size(); i++) {         // includes grows as nested headers are found.
+            std::shared_future<Header> future = get(includes[i], options, stats, errors);
+            const Header& header = future.get();
+            ok = header.ok && ok;
+            for (auto& nested : header.includes) {
+                if (std::find(includes.begin(), includes.end(), nested) == includes.end())
+                    includes.push_back(nested);
+            }
+        }
+        return ok;
+    }
+
+private:
+    struct Header {
+        bool ok = true;
+        std::vector<std::filesystem::path> includes;       // Headers included by this header.
+    };
+
+    struct Entry {
+        std::filesystem::file_time_type time;
+        std::shared_future<Header> header;
+    };
+
+    // Get the header at path, extracting it if this is the first request for it since it changed. Others requesting it meanwhile
+    // wait for the result. A header is extracted without extracting the headers it includes, which can't deadlock.
+    std::shared_future<Header> get(const std::filesystem::path& path, const FxOptions& options, StatsReport& stats, std::ostream& errors) {
+        std::error_code ec;
+        std::filesystem::file_time_type time = std::filesystem::last_write_time(path, ec);
+        std::promise<Header> promise;
+        std::shared_future<Header> future;
+        {
+            std::lock_guard lock(m_mutex);
+            auto [iter, inserted] = m_headers.try_emplace(path);
+            if (!inserted && iter->second.time == time)
+                return iter->second.header;
+
+            iter->second.time = time;
+            iter->second.header = future = promise.get_future().share();
+        }
+
+        promise.set_value(extract(path, options, stats, errors));
+        return future;
+    }
+
+    Header extract(const std::filesystem::path& path, FxOptions options, StatsReport& stats, std::ostream& errors) const {
+        Header header;
+        auto start = std::chrono::steady_clock::now();
+        MappedFile inFile(path);
+        if (!inFile.isOpen()) {
+            errors << "Could not open input file " << path.string() << "\n";
+            header.ok = false;
+            return header;
+        }
+        double ioSeconds = secondsSince(start);
+
+        std::string output;
+        options.sourceFile = path;
+        followIncludes(options, header.includes);
+        start = std::chrono::steady_clock::now();
+        FxResult result = extractFx(inFile.view(), output, options);
+        result.stats.lexSeconds = secondsSince(start);
+        printDiagnostics(errors, path, result.diagnostics);
+        output += errorMarkers(path, result.diagnostics);
+
+        start = std::chrono::steady_clock::now();
+        header.ok = writeIfChanged(mirrorPath(path), output, errors) && writeSourceMap(mirrorPath(path), options, result, errors) && result.ok;
+        result.stats.ioSeconds = ioSeconds + secondsSince(start);
+        stats.add(path, result.stats, false);
+        return header;
+    }
+
+    // Absolute normalized path of the header name included from dir, or empty if it is not found.
+    std::filesystem::path find(std::string_view name, const std::filesystem::path& dir) const {
+        auto check = [](const std::filesystem::path& candidate) {
+            std::error_code ec;
+            if (!std::filesystem::is_regular_file(candidate, ec))
+                return std::filesystem::path();
+            return std::filesystem::absolute(candidate, ec).lexically_normal();
+        };
+
+        std::filesystem::path header = check(dir / name);
+        for (size_t i = 0; header.empty() && i < m_includePaths.size(); i++)
+            header = check(m_includePaths[i] / name);
+        return header;
+    }
+
+    // Path of the extracted header, which includes any drive letter or server name in the absolute path.
+    std::filesystem::path mirrorPath(const std::filesystem::path& header) const {
+        std::string root = header.root_name().string();
+        std::erase_if(root, [](char c) { return c == ':' || c == '/' || c == '\\'; });
+        return m_mirrorDir / root / header.relative_path();
+    }
+
+    std::filesystem::path m_mirrorDir;
+    std::vector<std::filesystem::path> m_includePaths;
+    std::mutex m_mutex;
+    std::map<std::filesystem::path, Entry> m_headers;
+};
+
+// Make style dependency file written with --depfile, with a rule for each output file listing its input and the headers it includes.
+// Thread safe.
+class Depfile {
+public:
+    explicit Depfile(std::filesystem::path path) : m_path(std::move(path)) {}
+
+    bool enabled() const { return !m_path.empty(); }
+
+    void add(const std::filesystem::path& output, const std::filesystem::path& input, const std::vector<std::filesystem::path>& headers) {
+        if (!enabled())
+            return;
+
+        std::string rule = escape(output) + ":";
+        rule += " \\\n  " + escape(input);
+        for (auto& header : headers)
+            rule += " \\\n  " + escape(header);
+
+        std::lock_guard lock(m_mutex);
+        m_rules[output] = rule + "\n";
+    }
+
+    // Write the rules sorted by output, so that the file only changes if the dependencies do.
+    bool write(std::ostream& errors) const {
+        if (!enabled())
+            return true;
+
+        std::string contents;
+        for (auto& rule : m_rules)
+            contents += rule.second;
+        return writeIfChanged(m_path, contents, errors);
+    }
+
+private:
+    static std::string escape(const std::filesystem::path& path) {
+        std::string ret;
+        for (char c : path.generic_string()) {
+            if (c == ' ' || c == '#')
+                ret += '\\';
+            else if (c == '$')
+                ret += '$';
+            ret += c;
+        }
+        return ret;
+    }
+
+    std::filesystem::path m_path;
+    std::mutex m_mutex;
+    std::map<std::filesystem::path, std::string> m_rules;
+};
+
+// Translates positions in compiler diagnostics which refer to extracted files with source maps to positions in their inputs.
+// Positions are recognized as file(line) and file(line,column) as written by MSVC, and file:line and file:line:column as written
+// by GCC and Clang. The file is taken to start at the start of the line or after a space, and is looked up with a .fxmap suffix.
+class DiagnosticMapper {
+public:
+    std::string translate(std::string_view line) {
+        std::string ret;
+        size_t done = 0;            // Length of line already in ret.
+        for (size_t pos = 0; pos + 1 < line.size(); pos++) {
+            if ((line[pos] != '(' && line[pos] != ':') || !FxCharClass::isDigit(line[pos + 1]))
+                continue;
+
+            // Parse the position after the file name.
+            size_t end = pos + 1;
+            int lineNo = number(line, end);
+            int column = 0;
+            if (end < line.size() && line[end] == (line[pos] == '(' ? ',' : ':') && end + 1 < line.size() && FxCharClass::isDigit(line[end + 1])) {
+                end++;
+                column = number(line, end);
+            }
+            if (line[pos] == '(') {
+                if (end == line.size() || line[end] != ')')
+                    continue;
+                end++;
+            }
+
+            // Try the longest file name first.
+            for (size_t start = done; start < pos; start++) {
+                if (start != 0 && line[start - 1] != ' ')
+                    continue;
+
+                const FxSourceMap* map = find(line.substr(start, pos - start));
+                if (map == nullptr)
+                    continue;
+
+                auto [inLine, inColumn] = map->translate(lineNo, column);
+                ret.append(line, done, start - done);
+                ret += map->sourceFile();
+                if (line[pos] == '(')
+                    ret += column != 0 ? std::format("({},{})", inLine, inColumn) : std::format("({})", inLine);
+                else
+                    ret += column != 0 ? std::format(":{}:{}", inLine, inColumn) : std::format(":{}", inLine);
+                done = end;
+                pos = end - 1;
+                break;
+            }
+        }
+        ret.append(line, done);
+        return ret;
+    }
+
+private:
+    static int number(std::string_view text, size_t& pos) {
+        int ret = 0;
+        pos = size_t(std::from_chars(text.data() + pos, text.data() + text.size(), ret).ptr - text.data());
+        return ret;
+    }
+
+    // The source map of the extracted file at path, or nullptr if it has none. Maps are loaded once.
+    const FxSourceMap* find(std::string_view path) {
+        auto iter = m_maps.find(path);
+        if (iter == m_maps.end()) {
+            auto loaded = std::make_unique<Loaded>(sourceMapPath(std::filesystem::path(path)));
+            loaded->ok = loaded->file.isOpen() && loaded->map.load(loaded->file.view());
+            iter = m_maps.emplace(path, std::move(loaded)).first;
+        }
+        return iter->second->ok ? &iter->second->map : nullptr;
+    }
+
+    struct Loaded {
+        explicit Loaded(const std::filesystem::path& path) : file(path) {}
+
+        MappedFile file;
+        FxSourceMap map;
+        bool ok = false;
+    };
+
+    std::map<std::string, std::unique_ptr<Loaded>, std::less<>> m_maps;
+};
+
+// Copy compiler diagnostics from in to out, translating positions in extracted files with source maps, for --map-diagnostics.
+int mapDiagnostics(std::istream& in, std::ostream& out)
+{
+    DiagnosticMapper mapper;
+    for (std::string line; getline(in, line); )
+        out << mapper.translate(line) << '\n';
+    return 0;
+}
+
+// Smallest part of a file given to a thread when extracting it using several threads.
+const size_t minChunkSize = 256 * 1024;
+
+// Extract input to output, which is appended to, using threadCount threads if the input is large enough to split into parts.
+FxResult extractParallel(std::string_view input, std::string& output, const FxOptions& options, unsigned threadCount)
+{
+    size_t chunkSize = std::max(minChunkSize, input.size() / (size_t(threadCount) * 4) + 1);
+    if (threadCount <= 1 || input.size() < 2 * chunkSize)
+        return extractFx(input, output, options);
+
+    return extractFxChunked(input, output, options, chunkSize, [threadCount](std::vector<std::function<void()>>& tasks) {
+        ThreadPool pool(threadCount);
+        for (auto& task : tasks)
+            pool.submit(task);
+        pool.wait();
+    });
+}
+
+// Extract input to output, which is assigned, using the cache if enabled. cached is set if the output came from the cache. Large
+// inputs are split into parts extracted by threadCount threads.
+FxResult extractCached(std::string_view input, const FxOptions& options, const ResultCache& cache, std::string& output, bool& cached,
+                       unsigned threadCount = 1)
+{
+    std::filesystem::path cacheEntry;
+    output.clear();
+    cached = false;
+    bool useCache = cache.enabled() && !options.includeResolver && !options.sourceMap;   // Where includes are found is not part of the key,
+                                                                                         // and source maps are not cached.
+    if (useCache) {
+        cacheEntry = cache.entryPath(input, options);
+        if (cache.find(cacheEntry, output)) {
+            cached = true;
+            FxResult result;
+            result.stats.bytesRead = input.size();
+            result.stats.bytesWritten = output.size();
+            return result;
+        }
+    }
+
+    FxResult result = extractParallel(input, output, options, threadCount);
+    if (result.ok && useCache)
+        cache.store(cacheEntry, output);
+
+    return result;
+}
+
+// Extract one file to another. Error messages go to errors so that concurrent jobs don't mix their output.
+// The headers followed are stored in followed, if given.
+bool extractFile(const FileJob& job, FxOptions options, const ResultCache& cache, HeaderCache& headers, Depfile& depfile, StatsReport& stats,
+                 std::ostream& errors, unsigned threadCount = 1, std::vector<std::filesystem::path>* followed = nullptr)
+{
+    auto start = std::chrono::steady_clock::now();
+    MappedFile inFile(job.input);
+    if (!inFile.isOpen()) {
+        errors << "Could not open input file " << job.input.string() << "\n";
+        return false;
+    }
+    double ioSeconds = secondsSince(start);
+
+    thread_local std::string output;        // Reused by all files processed by a thread.
+    options.sourceFile = job.input;
+    std::vector<std::filesystem::path> includes;
+    if (headers.enabled())
+        headers.followIncludes(options, includes);
+
+    bool cached;
+    start = std::chrono::steady_clock::now();
+    FxResult result = extractCached(inFile.view(), options, cache, output, cached, threadCount);
+    result.stats.lexSeconds = secondsSince(start);
+    printDiagnostics(errors, job.input, result.diagnostics);
+    output += errorMarkers(job.input, result.diagnostics);
+
+    start = std::chrono::steady_clock::now();
+    bool written = writeIfChanged(job.output, output, errors) && writeSourceMap(job.output, options, result, errors);
+    result.stats.ioSeconds = ioSeconds + secondsSince(start);
+    stats.add(job.input, result.stats, cached);
+
+    bool headersOk = headers.extractHeaders(includes, options, stats, errors);
+    depfile.add(job.output, job.input, includes);
+    if (followed != nullptr)
+        *followed = std::move(includes);
+    return written && result.ok && headersOk;
+}
+
+// Parse an in=out pair from the command line or a batch list file.
+bool parseJob(std::string_view pair, std::vector<FileJob>& jobs)
+{
+    size_t eq = pair.find('=');
+    if (eq == std::string_view::npos || eq == 0 || eq == pair.size() - 1)
+        return false;
+
+    jobs.push_back({ std::filesystem::path(pair.substr(0, eq)), std::filesystem::path(pair.substr(eq + 1)) });
+    return true;
+}
+
+// Read a batch list file with one in=out pair per line. Empty lines and lines starting with # are ignored.
+bool readBatchFile(const std::filesystem::path& path, std::vector<FileJob>& jobs)
+{
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open batch file " << path.string() << "\n";
+        return false;
+    }
+
+    std::string line;
+    int lineNo = 0;
+    while (getline(in, line)) {
+        lineNo++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        if (!parseJob(line, jobs)) {
+            std::cerr << std::format("{}({}): Expected <inFile>=<outFile>, got: {}\n", path.string(), lineNo, line);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Extract the jobs with the given indices using a pool of worker threads, storing the headers each job follows in followed. Failed
+// files are reported with their error messages as they finish. Returns the number of failed files.
+int extractJobs(const std::vector<FileJob>& jobs, const std::vector<size_t>& indices, const FxOptions& options, const ResultCache& cache,
+                HeaderCache& headers, Depfile& depfile, StatsReport& stats, unsigned threadCount,
+                std::vector<std::vector<std::filesystem::path>>& followed)
+{
+    std::mutex reportMutex;
+    std::atomic<int> failed = 0;
+
+    ThreadPool pool(unsigned(std::min<size_t>(threadCount, indices.size())));
+    for (size_t ix : indices) {
+        pool.submit([&, ix] {
+            std::ostringstream errors;
+            if (extractFile(jobs[ix], options, cache, headers, depfile, stats, errors, 1, &followed[ix]))
+                return;
+
+            failed++;
+            std::lock_guard lock(reportMutex);
+            std::cerr << "FAILED " << jobs[ix].input.string() << ":\n" << errors.str();
+        });
+    }
+    pool.wait();
+    return failed;
+}
+
+// Extract all jobs using a pool of worker threads.
+int runBatch(const std::vector<FileJob>& jobs, const FxOptions& options, const ResultCache& cache, HeaderCache& headers, Depfile& depfile,
+             StatsReport& stats, unsigned threadCount)
+{
+    std::vector<size_t> indices(jobs.size());
+    std::iota(indices.begin(), indices.end(), size_t(0));
+    std::vector<std::vector<std::filesystem::path>> followed(jobs.size());
+    int failed = extractJobs(jobs, indices, options, cache, headers, depfile, stats, threadCount, followed);
+    if (failed > 0)
+        std::cerr << failed << " of " << jobs.size() << " files failed.\n";
+
+    return failed > 0 ? 1 : 0;
+}
+
+// Time without changes to wait for after a change before extracting, so that a burst of saves is handled at once.
+constexpr int watchQuietMs = 100;
+
+// How much file time stamps may lag the clock, see runWatch().
+constexpr int watchClockSlackMs = 20;
+
+// Extract all jobs, then keep the outputs up to date until interrupted, for --watch. When the input of a job or a header it follows
+// changes the job is extracted again, which also extracts the changed headers. As output files are only written if they change
+// the build finds the outputs up to date.
+int runWatch(const std::vector<FileJob>& jobs, const FxOptions& options, const ResultCache& cache, HeaderCache& headers, Depfile& depfile,
+             StatsReport& stats, unsigned threadCount)
+{
+    FileWatcher watcher;
+    std::vector<std::filesystem::path> inputs;
+    for (auto& job : jobs)
+        inputs.push_back(std::filesystem::absolute(job.input).lexically_normal());
+
+    // The inputs are watched before they are first extracted, so that one saved while a round runs is found by the next wait().
+    for (auto& input : inputs) {
+        if (!watcher.watch(input))
+            std::cerr << "Could not watch the directory of " << input.string() << "\n";
+    }
+
+    std::vector<std::vector<std::filesystem::path>> followed(jobs.size());
+    std::vector<size_t> indices(jobs.size());
+    std::iota(indices.begin(), indices.end(), size_t(0));
+    while (true) {
+        auto roundStart = std::filesystem::file_time_type::clock::now() - std::chrono::milliseconds(watchClockSlackMs);
+        int failed = extractJobs(jobs, indices, options, cache, headers, depfile, stats, threadCount, followed);
+        if (failed > 0)
+            std::cerr << failed << " of " << indices.size() << " files failed.\n";
+        depfile.write(std::cerr);
+
+        // The headers followed are only known after extracting, so a header saved while the round ran but before it was watched
+        // is found by its time stamp instead, and the files including it are extracted again at once.
+        std::vector<size_t> stale;
+        for (size_t ix : indices) {
+            bool changed = false;
+            for (auto& header : followed[ix]) {
+                if (!watcher.watch(header))
+                    std::cerr << "Could not watch the directory of " << header.string() << "\n";
+                std::error_code ec;
+                auto time = std::filesystem::last_write_time(header, ec);
+                changed = changed || (!ec && time >= roundStart);
+            }
+            if (changed)
+                stale.push_back(ix);
+        }
+        if (!stale.empty()) {
+            indices = std::move(stale);
+            continue;
+        }
+
+        std::set<std::filesystem::path> changed = watcher.wait(watchQuietMs);
+        if (changed.empty()) {
+            std::cerr << "Could not wait for file changes.\n";
+            return 1;
+        }
+
+        indices.clear();
+        for (size_t ix = 0; ix < jobs.size(); ix++) {
+            if (changed.contains(inputs[ix]) || std::any_of(followed[ix].begin(), followed[ix].end(), [&](auto& header) { return changed.contains(header); }))
+                indices.push_back(ix);
+        }
+    }
+}
+
+// A request to a server started with --server. Each request is a number of lines starting with a keyword, ended by an end line:
+//
+//   extract <id>           Starts a request. id is returned in the response.
+//   in <path>              Input file, also used in #line directives.
+//   source <length>        Followed by length bytes of input, which is then not read from the in file.
+//   out <path>             Output file. If not given the output is returned in the response.
+//   name <function>        Function to wrap f-literals in, default from the command line.
+//   lines 0|1|compact      Disable, enable or enable compact #line directives, default from the command line.
+//   end
+//
+// The response, which may come in another order than the requests, is:
+//
+//   result <id> ok|failed
+//   output <length>        Followed by length bytes of output, only if no out file was given.
+//   sourcemap <length>     Followed by length bytes of serialized FxSourceMap, only with --source-map and no out file. With an out
+//                          file the source map is written to <out>.fxmap.
+//   diagnostics <length>   Followed by length bytes of error messages.
+//   end
+//
+// A quit line or end of input stops the server once all ongoing requests are done.
+struct ServerRequest {
+    std::string id;
+    std::filesystem::path input;
+    std::filesystem::path output;
+    std::string source;
+    bool hasSource = false;
+    FxOptions options;
+    bool hasName = false;
+    bool hasLines = false;
+};
+
+// Read a length prefixed payload following a header line.
+bool readPayload(std::istream& in, std::string_view length, std::string& payload)
+{
+    size_t size = 0;
+    auto [ptr, ec] = std::from_chars(length.data(), length.data() + length.size(), size);
+    if (ec != std::errc() || ptr != length.data() + length.size())
+        return false;
+
+    payload.resize(size);
+    return bool(in.read(payload.data(), std::streamsize(size)));
+}
+
+// Read the next request. Returns false at end of input or on a quit line. Malformed requests throw as the input can't be resynced.
+bool readRequest(std::istream& in, ServerRequest& request)
+{
+    std::string line;
+    while (getline(in, line) && line.empty())
+        ;                       // Allow empty lines between requests.
+
+    if (!in || line == "quit")
+        return false;
+    if (!line.starts_with("extract "))
+        throw std::runtime_error("Expected a line starting with 'extract', got: " + line);
+
+    request.id = line.substr(8);
+    while (getline(in, line) && line != "end") {
+        if (line.empty())
+            continue;           // Typically the line end after a payload.
+
+        size_t space = line.find(' ');
+        std::string_view key = std::string_view(line).substr(0, space);
+        std::string_view value = space == std::string::npos ? std::string_view() : std::string_view(line).substr(space + 1);
+        if (key == "in")
+            request.input = value;
+        else if (key == "out")
+            request.output = value;
+        else if (key == "name") {
+            request.options.functionName = value;
+            request.hasName = true;
+        }
+        else if (key == "lines") {
+            request.options.lineDirectives = value != "0";
+            request.options.compactLines = value == "compact";
+            request.hasLines = true;
+        }
+        else if (key == "source") {
+            if (!readPayload(in, value, request.source))
+                throw std::runtime_error("Malformed source in request " + request.id);
+            request.hasSource = true;
+        }
+        else
+            throw std::runtime_error(std::format("Unknown keyword {} in request {}", key, request.id));
+    }
+
+    if (!in)
+        throw std::runtime_error("Input ends inside request " + request.id);
+
+    return true;
+}
+
+// Serve extraction requests from stdin, answering on stdout. Requests are processed concurrently by a thread pool.
+int runServer(const FxOptions& options, const ResultCache& cache, HeaderCache& headers, StatsReport& stats, unsigned threadCount)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);     // Payload lengths are in bytes.
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    std::ios::sync_with_stdio(false);
+    std::mutex responseMutex;
+    ThreadPool pool(threadCount);
+    int status = 0;
+
+    try {
+        ServerRequest request;
+        while (readRequest(std::cin, request)) {
+            if (!request.hasName)
+                request.options.functionName = options.functionName;
+            if (!request.hasLines)
+                request.options.compactLines = options.compactLines;
+            request.options.skipDisabled = options.skipDisabled;
+            request.options.defines = options.defines;
+            request.options.undefines = options.undefines;
+            request.options.maxNesting = options.maxNesting;
+            request.options.maxErrors = options.maxErrors;
+            request.options.sourceMap = options.sourceMap;
+            request.options.sourceFile = request.input.empty() ? "<source>" : request.input;
+
+            pool.submit([&, request = std::move(request)] {
+                thread_local std::string output;        // Buffers reused between requests handled by this thread.
+                thread_local std::ostringstream errors;
+                output.clear();
+                errors.str({});
+                std::string sourceMap;
+
+                bool ok = false;
+                std::unique_ptr<MappedFile> inFile;
+                std::string_view input = request.source;
+                if (!request.hasSource) {
+                    inFile = std::make_unique<MappedFile>(request.input);
+                    input = inFile->view();
+                    if (!inFile->isOpen())
+                        errors << "Could not open input file " << request.input.string() << "\n";
+                }
+                if (request.hasSource || inFile->isOpen()) {
+                    FxOptions requestOptions = request.options;
+                    std::vector<std::filesystem::path> includes;
+                    if (headers.enabled())
+                        headers.followIncludes(requestOptions, includes);
+
+                    bool cached;
+                    auto start = std::chrono::steady_clock::now();
+                    FxResult result = extractCached(input, requestOptions, cache, output, cached);
+                    result.stats.lexSeconds = secondsSince(start);
+                    printDiagnostics(errors, request.options.sourceFile, result.diagnostics);
+                    output += errorMarkers(request.options.sourceFile, result.diagnostics);
+                    ok = result.ok;
+                    if (!request.output.empty()) {
+                        start = std::chrono::steady_clock::now();
+                        ok = writeIfChanged(request.output, output, errors) && writeSourceMap(request.output, requestOptions, result, errors) && ok;
+                        result.stats.ioSeconds = secondsSince(start);
+                    }
+                    else if (requestOptions.sourceMap)
+                        sourceMap = FxSourceMap::serialize(requestOptions.sourceFile.string(), result.sourceMap);
+                    stats.add(request.options.sourceFile, result.stats, cached);
+                    ok = headers.extractHeaders(includes, requestOptions, stats, errors) && ok;
+                }
+                std::string diagnostics = errors.str();
+
+                std::lock_guard lock(responseMutex);
+                std::cout << "result " << request.id << (ok ? " ok\n" : " failed\n");
+                if (request.output.empty())
+                    std::cout << "output " << output.size() << "\n" << output;
+                if (request.output.empty() && options.sourceMap)
+                    std::cout << "sourcemap " << sourceMap.size() << "\n" << sourceMap;
+                std::cout << "diagnostics " << diagnostics.size() << "\n" << diagnostics << "end\n";
+                std::cout.flush();
+            });
+            request = {};
+        }
+    }
+    catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << "\n";
+        status = 1;
+    }
+
+    pool.wait();
+    return status;
+}
+
+// Get the value of an option given as --opt=value, --opt:value or --opt value. Returns false if arg is not this option.
+bool optionValue(int argc, char** argv, int& argn, std::string_view option, std::string& value)
+{
+    std::string_view arg = argv[argn];
+    if (!arg.starts_with(option))
+        return false;
+
+    arg.remove_prefix(option.size());
+    if (!arg.empty() && (arg[0] == '=' || arg[0] == ':')) {
+        value = arg.substr(1);
+        return true;
+    }
+    if (!arg.empty())
+        return false;       // Some other option with the same prefix.
+
+    if (argn + 1 >= argc)
+        throw std::runtime_error(std::format("{} must be followed by a value.", option));
+
+    value = argv[++argn];
+    return true;
+}
+
+// Extract stdin or the only file in files to stdout.
+int extractToStdout(const std::vector<std::string>& files, FxOptions options, HeaderCache& headers, StatsReport& stats, unsigned threadCount)
+{
+    std::filesystem::path inputPath  = "<stdin>";
+    options.sourceFile = inputPath;
+    FxFdSink sink(1);                                       // Standard output.
+    std::vector<std::filesystem::path> includes;
+    if (files.empty() && options.streaming) {
+        if (headers.enabled())
+            headers.followIncludes(options, includes);
+
+        // Read stdin line by line and write output as soon as possible.
+        FxResult result;
+        auto start = std::chrono::steady_clock::now();
+        FxExtractor extractor(sink, std::cin, options);
+        result.ok = extractor.process(result.diagnostics);
+        result.stats = extractor.stats();
+        result.stats.lexSeconds = secondsSince(start);      // Includes waiting for input.
+        stats.add(inputPath, result.stats, false);
+        printDiagnostics(std::cerr, inputPath, result.diagnostics);
+        sink.write(errorMarkers(inputPath, result.diagnostics));
+        bool headersOk = headers.extractHeaders(includes, options, stats, std::cerr);
+        if (!sink.close()) {
+            std::cerr << "Could not write to standard output\n";
+            return 1;
+        }
+        return result.ok && headersOk ? 0 : 1;
+    }
+
+    std::unique_ptr<MappedFile> inFile;
+    std::string stdinContents;
+    std::string_view input;
+    auto start = std::chrono::steady_clock::now();
+    if (files.size() == 1) {
+        inputPath = files[0];
+        inFile = std::make_unique<MappedFile>(inputPath);
+        if (!inFile->isOpen()) {
+            std::cerr << "Could not open input file " << inputPath.string() << "\n";
+            return 1;
+        }
+        input = inFile->view();
+    }
+    else {
+        stdinContents = MappedFile::readAll(std::cin);
+        input = stdinContents;
+    }
+
+    double ioSeconds = secondsSince(start);
+
+    options.sourceFile = inputPath;
+    if (headers.enabled())
+        headers.followIncludes(options, includes);
+
+    start = std::chrono::steady_clock::now();
+    FxResult result;
+    if (threadCount > 1 && input.size() >= 2 * minChunkSize) {
+        std::string output;
+        result = extractParallel(input, output, options, threadCount);
+        sink.write(output);
+    }
+    else
+        result = extractFx(input, sink, options);
+    result.stats.lexSeconds = secondsSince(start);          // Includes writing to stdout.
+    result.stats.ioSeconds = ioSeconds;
+    stats.add(inputPath, result.stats, false);
+    printDiagnostics(std::cerr, inputPath, result.diagnostics);
+    sink.write(errorMarkers(inputPath, result.diagnostics));
+    bool headersOk = headers.extractHeaders(includes, options, stats, std::cerr);
+    if (!sink.close()) {
+        std::cerr << "Could not write to standard output\n";
+        return 1;
+    }
+    return result.ok && headersOk ? 0 : 1;
+}
+
+// Run command, found in the PATH, and wait for it to finish. If input is given it is written to the standard input of the command,
+// otherwise standard input is inherited. Returns the exit status of the command, or -1 if it could not be started.
+int runProcess(const std::vector<std::string>& command, const std::string_view* input)
+{
+#ifdef _WIN32
+    std::string commandLine;
+    for (auto& arg : command)
+        commandLine += (commandLine.empty() ? "" : " ") + quoteArgument(arg);
+
+    STARTUPINFOA startup = { sizeof(startup) };
+    HANDLE readPipe = nullptr;
+    HANDLE writePipe = nullptr;
+    if (input != nullptr) {
+        SECURITY_ATTRIBUTES attributes = { sizeof(attributes), nullptr, TRUE };
+        if (!CreatePipe(&readPipe, &writePipe, &attributes, 0))
+            return -1;
+
+        SetHandleInformation(writePipe, HANDLE_FLAG_INHERIT, 0);       // Else the command never sees the end of its input.
+        startup.dwFlags = STARTF_USESTDHANDLES;
+        startup.hStdInput = readPipe;
+        startup.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    }
+
+    PROCESS_INFORMATION process;
+    bool started = CreateProcessA(nullptr, commandLine.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process) != 0;
+    if (readPipe != nullptr)
+        CloseHandle(readPipe);
+    if (!started) {
+        if (writePipe != nullptr)
+            CloseHandle(writePipe);
+        return -1;
+    }
+
+    if (input != nullptr) {
+        int fd = _open_osfhandle(intptr_t(writePipe), _O_BINARY);
+        FxFdSink sink(fd);
+        sink.write(*input);
+        sink.close();                   // A failed write means that the command stopped reading, it reports why.
+        _close(fd);
+    }
+
+    DWORD status = 1;
+    WaitForSingleObject(process.hProcess, INFINITE);
+    GetExitCodeProcess(process.hProcess, &status);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    return int(status);
+#else
+    std::vector<char*> argv;
+    for (auto& arg : command)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    int fds[2] = { -1, -1 };
+    if (input != nullptr && ::pipe(fds) != 0)
+        return -1;
+
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        if (input != nullptr) {
+            ::dup2(fds[0], 0);
+            ::close(fds[0]);
+            ::close(fds[1]);
+        }
+        ::execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    if (input != nullptr) {
+        ::close(fds[0]);
+        if (pid > 0) {
+            ::signal(SIGPIPE, SIG_IGN);     // The command may stop reading, it then reports why.
+            FxFdSink sink(fds[1]);
+            sink.write(*input);
+            sink.close();
+        }
+        ::close(fds[1]);
+    }
+    if (pid < 0)
+        return -1;
+
+    int status = 0;
+    while (::waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status) == 127 ? -1 : WEXITSTATUS(status);
+    return 128 + WTERMSIG(status);
+#endif
+}
+
+// Run a compiler command with its source file extracted in memory, for --launch, so that extract_fx can be used as a compiler
+// launcher. Compilers other than MSVC get the extracted source on stdin using -x c++ -, with -iquote for the directory of the
+// source. As cl can't read stdin the extracted source is written to a temporary file for MSVC style compilers. Commands without a
+// single source file, like links, are run as they are.
+int launchCompiler(std::vector<std::string> command, FxOptions options, HeaderCache& headers, StatsReport& stats)
+{
+    bool msvc = isMsvcCompiler(command[0]);
+    size_t sourceIx = findSourceFile(command, msvc);
+    if (sourceIx == 0) {
+        // Running a compilation unextracted would only give confusing errors for its f/x literals.
+        if (std::any_of(command.begin() + 1, command.end(), [&](auto& arg) { return arg == "-c" || (msvc && arg == "/c"); })) {
+            std::cerr << "--launch found no single source file to extract in the compile command\n";
+            return 1;
+        }
+
+        int status = runProcess(command, nullptr);
+        if (status < 0)
+            std::cerr << "Could not run " << command[0] << "\n";
+        return status < 0 ? 1 : status;
+    }
+
+    std::string_view source = command[sourceIx];
+    bool tpPrefix = msvc && (source.starts_with("/T") || source.starts_with("-T"));      // Source given as /Tp<file>
+    bool c = tpPrefix ? source[2] == 'c' : std::filesystem::path(source).extension() == ".c";
+    std::filesystem::path inputPath = tpPrefix ? source.substr(3) : source;
+
+    auto start = std::chrono::steady_clock::now();
+    MappedFile inFile(inputPath);
+    if (!inFile.isOpen()) {
+        std::cerr << "Could not open input file " << inputPath.string() << "\n";
+        return 1;
+    }
+    double ioSeconds = secondsSince(start);
+
+    options.sourceFile = inputPath;
+    std::vector<std::filesystem::path> includes;
+    if (headers.enabled())
+        headers.followIncludes(options, includes);
+
+    std::string output;
+    start = std::chrono::steady_clock::now();
+    FxResult result = extractFx(inFile.view(), output, options);
+    result.stats.lexSeconds = secondsSince(start);
+    result.stats.ioSeconds = ioSeconds;
+    stats.add(inputPath, result.stats, false);
+    printDiagnostics(std::cerr, inputPath, result.diagnostics);
+    bool headersOk = headers.extractHeaders(includes, options, stats, std::cerr);
+    if (!result.ok || !headersOk)
+        return 1;
+
+    // Quoted includes are searched for next to the source file first.
+    std::filesystem::path dir = inputPath.parent_path().empty() ? "." : inputPath.parent_path();
+    std::string_view input = output;
+    std::filesystem::path tempPath;
+    if (msvc) {
+        tempPath = std::filesystem::temp_directory_path() / std::format("{}-{:016x}-{}{}", inputPath.stem().string(), hashBytes(inputPath.string()),
+                                                                         std::chrono::steady_clock::now().time_since_epoch().count(), inputPath.extension().string());
+        if (!writeIfChanged(tempPath, output, std::cerr))
+            return 1;
+
+        if (tpPrefix || sourceIx == 1 || (command[sourceIx - 1] != "/Tp" && command[sourceIx - 1] != "-Tp" && command[sourceIx - 1] != "/Tc" && command[sourceIx - 1] != "-Tc"))
+            command[sourceIx] = (c ? "/Tc" : "/Tp") + tempPath.string();
+        else
+            command[sourceIx] = tempPath.string();
+        command.insert(command.begin() + 1, "/I" + dir.string());
+    }
+    else {
+        command[sourceIx] = "-";
+        command.insert(command.begin() + sourceIx, { "-x", c ? "c" : "c++" });
+        command.insert(command.begin() + 1, { "-iquote", dir.string() });
+    }
+
+    int status = runProcess(command, msvc ? nullptr : &input);
+    if (!tempPath.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(tempPath, ec);
+    }
+    if (status < 0)
+        std::cerr << "Could not run " << command[0] << "\n";
+    return status < 0 ? 1 : status;
+}
+
+const char* usage = 
+    "Usage: extract_fx [--name <function>] [<inFile> [<outFile>]]\n"
+    "       extract_fx [--name <function>] [-j <threads>] [--batch <listFile>] [<inFile>=<outFile> ...]\n"
+    "If no files are given reads from stdin, if no outFile is given writes to stdout.\n"
+    "       extract_fx [--name <function>] [-j <threads>] --server\n"
+    "       extract_fx --map-diagnostics\n"
+    "       extract_fx [--name <function>] --launch <compiler> <args>...\n"
+    "With --stream stdin is read line by line and output is written as soon as it can't change anymore.\n"
+    "With --compact-lines #line directives are only written where needed to keep line numbers right, and without column padding.\n"
+    "With --follow-includes <dir> quoted #includes found next to the including file or in the -I<dir> paths are extracted to a\n"
+    "mirror of their absolute paths in dir, and the #includes are changed to name the extracted headers.\n"
+    "With --depfile <file> a Make style dependency file listing the input and followed headers of each output file is written.\n"
+    "With --source-map no #line directives are written, instead a source map is written to <outFile>.fxmap for each output,\n"
+    "or with --server returned in responses without an out file.\n"
+    "With --max-nesting <n> f/x literals nested more than n deep in expression-fields of each other are errors, by default 256.\n"
+    "With --max-errors <n> at most n errors are reported for each file, by default 20. Output with errors ends in #error directives.\n"
+    "With --skip-disabled #if groups known to be disabled, also using -D<macro>[=<value>] and -U<macro>, are copied without lexing.\n"
+    "Output files are only written if their contents change. With --cache <dir> results are cached in dir, keyed by input hash.\n"
+    "With --server extraction requests are read from stdin and answered on stdout, see runServer().\n"
+    "With --stats[=json] counters and times for each file and in total are printed to stderr when done, as text or JSON.\n"
+    "In batch mode all in=out pairs on the command line and in listFile (one per line) are processed by a pool of threads.\n"
+    "With --watch batch mode goes on until interrupted, extracting files again when they or the headers they follow change.\n"
+    "With --map-diagnostics compiler diagnostics are copied from stdin to stdout, translating positions in output files with source\n"
+    "maps to positions in their input files.\n"
+    "With --launch the compiler command following it is run with its source file extracted in memory and piped to the compiler,\n"
+    "for use as a compiler launcher.\n"
+    "If --test is the only parameter does a self test. --test-watcher tests watching files for --watch, using temporary files.\n";
+
+// Process stdin -> stdout, file -> stdout, file -> file or a batch of files.
+int main(int argc, char** argv)
+{
+    if (argc == 2 && strcmp(argv[1], "--test") == 0) {
+        std::cerr << "Performing self test\nNote: Negative testing will produce some printout here. Actual errors start with 'ERROR'\n";
+        return test();
+    }
+    if (argc == 2 && strcmp(argv[1], "--test-watcher") == 0)
+        return testWatcher() ? 0 : 1;
+    if (argc == 2 && strcmp(argv[1], "--map-diagnostics") == 0)
+        return mapDiagnostics(std::cin, std::cout);
+
+    FxOptions options;
+    std::vector<FileJob> jobs;
+    std::vector<std::string> files;
+    bool batch = false;
+    bool server = false;
+    bool watch = false;
+    std::vector<std::string> launch;
+    StatsReport::Format statsFormat = StatsReport::Format::none;
+    std::filesystem::path cacheDir;
+    std::filesystem::path mirrorDir;
+    std::filesystem::path depfilePath;
+    std::vector<std::filesystem::path> includePaths;
+    unsigned threadCount = ThreadPool::defaultThreadCount();
+
+    try {
+        for (int argn = 1; argn < argc; argn++) {
+            std::string_view arg = argv[argn];
+            std::string value;
+            if (arg == "-h" || arg == "--help") {
+                std::cerr << usage;
+                return 0;
+            }
+            else if (optionValue(argc, argv, argn, "--name", value))
+                options.functionName = value;
+            else if (arg == "--stream")
+                options.streaming = true;
+            else if (arg == "--compact-lines")
+                options.compactLines = true;
+            else if (arg == "--skip-disabled")
+                options.skipDisabled = true;
+            else if (arg == "--source-map")
+                options.sourceMap = true;
+            else if (optionValue(argc, argv, argn, "--max-nesting", value)) {
+                options.maxNesting = std::atoi(value.c_str());
+                if (options.maxNesting <= 0)
+                    throw std::runtime_error("--max-nesting must be followed by a positive number.");
+            }
+            else if (optionValue(argc, argv, argn, "--max-errors", value)) {
+                options.maxErrors = std::atoi(value.c_str());
+                if (options.maxErrors <= 0)
+                    throw std::runtime_error("--max-errors must be followed by a positive number.");
+            }
+            else if (optionValue(argc, argv, argn, "--follow-includes", value))
+                mirrorDir = value;
+            else if (optionValue(argc, argv, argn, "--depfile", value))
+                depfilePath = value;
+            else if (arg.starts_with("-D") || arg.starts_with("-U") || arg.starts_with("-I")) {
+                value = arg.substr(2);
+                if (value.empty() && ++argn < argc)
+                    value = argv[argn];
+                if (value.empty())
+                    throw std::runtime_error(std::format("{} must be followed by a {}.", arg.substr(0, 2), arg[1] == 'I' ? "directory" : "macro name"));
+
+                if (arg[1] == 'I')
+                    includePaths.emplace_back(value);
+                else
+                    (arg[1] == 'D' ? options.defines : options.undefines).push_back(value);
+            }
+            else if (arg == "--server")
+                server = true;
+            else if (arg == "--watch")
+                watch = true;
+            else if (arg == "--launch") {
+                launch.assign(argv + argn + 1, argv + argc);       // The rest is the compiler command.
+                if (launch.empty())
+                    throw std::runtime_error("--launch must be followed by a compiler command.");
+                break;
+            }
+            else if (arg == "--stats" || arg == "--stats=text")
+                statsFormat = StatsReport::Format::text;
+            else if (arg == "--stats=json")
+                statsFormat = StatsReport::Format::json;
+            else if (optionValue(argc, argv, argn, "--cache", value))
+                cacheDir = value;
+            else if (optionValue(argc, argv, argn, "--batch", value)) {
+                if (!readBatchFile(value, jobs))
+                    return 1;
+                batch = true;
+            }
+            else if (arg.starts_with("-j")) {
+                value = arg.substr(2);
+                if (value.empty() && ++argn < argc)
+                    value = argv[argn];
+
+                threadCount = unsigned(std::atoi(value.c_str()));
+                if (threadCount == 0)
+                    throw std::runtime_error("-j must be followed by a positive number of threads.");
+            }
+            else if (arg.size() > 1 && arg[0] == '-')
+                throw std::runtime_error(std::format("Unknown option {}", arg));
+            else if (arg.find('=') != std::string_view::npos) {
+                parseJob(arg, jobs);
+                batch = true;
+            }
+            else
+                files.emplace_back(arg);
+        }
+
+        if (server && (batch || !files.empty()))
+            throw std::runtime_error("--server can't be combined with file names.");
+        if (!launch.empty() && (server || batch || !files.empty() || options.sourceMap || options.streaming))
+            throw std::runtime_error("--launch can't be combined with file names, --server, --source-map or --stream.");
+        if (watch && !batch)
+            throw std::runtime_error("--watch needs in=out pairs or --batch.");
+        if (batch && !files.empty())
+            throw std::runtime_error("Plain file names can't be mixed with in=out pairs or --batch.");
+        if (files.size() > 2)
+            throw std::runtime_error("Too many file names.");
+        if (!depfilePath.empty() && !batch && files.size() != 2)
+            throw std::runtime_error("--depfile needs output files.");
+        if (options.sourceMap && !batch && !server && files.size() != 2)
+            throw std::runtime_error("--source-map needs output files.");
+    }
+    catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << "\n" << usage;
+        return 1;
+    }
+
+    ResultCache cache(cacheDir);
+    HeaderCache headers(mirrorDir, std::move(includePaths));
+    Depfile depfile(depfilePath);
+    StatsReport stats(statsFormat);
+    int status;
+    if (!launch.empty())
+        status = launchCompiler(std::move(launch), options, headers, stats);
+    else if (server)
+        status = runServer(options, cache, headers, stats, threadCount);
+    else if (batch && watch)
+        status = runWatch(jobs, options, cache, headers, depfile, stats, threadCount);
+    else if (batch)
+        status = runBatch(jobs, options, cache, headers, depfile, stats, threadCount);
+    else if (files.size() == 2)
+        status = extractFile({ files[0], files[1] }, options, cache, headers, depfile, stats, std::cerr, threadCount) ? 0 : 1;
+    else
+        status = extractToStdout(files, options, headers, stats, threadCount);
+
+    if (!depfile.write(std::cerr))
+        status = 1;
+    stats.print(std::cerr);
+    return status;
+}
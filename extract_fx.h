@@ -0,0 +1,2341 @@
+// f/x literal extractor for C++ preprocessor.
+// By bengt.gustafsson@beamways.com
+// MIT license.
+
+// Header only library doing the actual extraction from an in memory input buffer. extract_fx.cpp adds the command line tool around it.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <istream>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+#include <bit>
+#include <cstdint>
+#include <cassert>
+#include <utility>
+#include <format>
+
+#include "fx_core.h"
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define FX_SSE2 1
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define FX_NEON 1
+#endif
+
+// Find the first of the characters Cs in [ptr, end) and return a pointer to it, or end if none of them is present. This is used
+// to pass over runs of characters which need no attention 16 or 32 at a time.
+template<char... Cs> inline const char* findFirstOf(const char* ptr, const char* end)
+{
+#if defined(__AVX2__)
+    while (end - ptr >= 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+        __m256i hits = _mm256_setzero_si256();
+        ((hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(Cs)))), ...);
+        if (uint32_t mask = uint32_t(_mm256_movemask_epi8(hits)))
+            return ptr + std::countr_zero(mask);
+
+        ptr += 32;
+    }
+#endif
+#if defined(FX_SSE2)
+    while (end - ptr >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+        __m128i hits = _mm_setzero_si128();
+        ((hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(Cs)))), ...);
+        if (uint32_t mask = uint32_t(_mm_movemask_epi8(hits)))
+            return ptr + std::countr_zero(mask);
+
+        ptr += 16;
+    }
+#elif defined(FX_NEON)
+    while (end - ptr >= 16) {
+        uint8x16_t block = vld1q_u8(reinterpret_cast<const uint8_t*>(ptr));
+        uint8x16_t hits = vdupq_n_u8(0);
+        ((hits = vorrq_u8(hits, vceqq_u8(block, vdupq_n_u8(uint8_t(Cs))))), ...);
+        // Narrow each byte of hits to 4 bits, there is no movemask on NEON.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+        if (mask != 0)
+            return ptr + std::countr_zero(mask) / 4;
+
+        ptr += 16;
+    }
+#endif
+    for (; ptr != end; ptr++) {
+        if (((*ptr == Cs) || ...))
+            return ptr;
+    }
+    return end;
+}
+
+
+// Count the occurrences of C in [ptr, end), 16 characters at a time. Used to count lines for the stats. The per lane counts of up to
+// 255 blocks are summed in 8 bits before adding them up, as a popcount instruction may not be available.
+template<char C> inline size_t countOf(const char* ptr, const char* end)
+{
+    size_t count = 0;
+#if defined(FX_SSE2)
+    while (end - ptr >= 16) {
+        __m128i sums = _mm_setzero_si128();
+        for (int i = 0; i < 255 && end - ptr >= 16; i++, ptr += 16)
+            sums = _mm_sub_epi8(sums, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr)), _mm_set1_epi8(C)));
+
+        __m128i total = _mm_sad_epu8(sums, _mm_setzero_si128());     // Two 64 bit sums of 8 lanes each.
+        count += size_t(_mm_cvtsi128_si32(total)) + size_t(_mm_extract_epi16(total, 4));
+    }
+#elif defined(FX_NEON)
+    while (end - ptr >= 16) {
+        uint8x16_t sums = vdupq_n_u8(0);
+        for (int i = 0; i < 255 && end - ptr >= 16; i++, ptr += 16)
+            sums = vsubq_u8(sums, vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(ptr)), vdupq_n_u8(uint8_t(C))));
+
+        uint64x2_t total = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(sums)));
+        count += size_t(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+    }
+#endif
+    for (; ptr != end; ptr++)
+        count += *ptr == C;
+
+    return count;
+}
+
+// Version of the extracted output. Change this whenever the output for some input changes, as it is part of the cache key.
+inline constexpr std::string_view extractFxVersion = "4";
+
+
+// Options controlling the extraction.
+struct FxOptions {
+    std::filesystem::path sourceFile = "<source>";     // File name used in #line directives.
+    std::string functionName = "std::format";          // Function to wrap f-literals in. A trailing * is replaced by <N>.
+    bool lineDirectives = true;                        // Emit #line directives so that errors in expression-fields get the right position.
+    bool compactLines = false;                         // Only emit #line directives where the line would be wrong, and without column padding.
+    bool prefilter = true;                             // Copy input buffers without any f/x literal verbatim, without checking for errors.
+    bool streaming = false;                            // Write output as soon as it can't change, and flush the sink before reading a line.
+    bool skipDisabled = false;                         // Copy #if groups known to be disabled without lexing them.
+    std::vector<std::string> defines{};                // Macros known to be defined for skipDisabled, as NAME or NAME=VALUE.
+    std::vector<std::string> undefines{};              // Macros known not to be defined for skipDisabled.
+    std::function<std::string(std::string_view name)> includeResolver{};  // Called for each quoted #include processed. A non-empty
+                                                                          // result replaces the header name.
+    bool sourceMap = false;                            // Collect FxResult::sourceMap instead of emitting #line directives.
+    int maxNesting = 256;                              // Most f/x literals nested in expression-fields of each other.
+    int maxErrors = 20;                                // Most errors to report. Lexing resynchronizes after each error before that.
+};
+
+// An error found in the input. Lines and columns start at 1.
+struct FxDiagnostic {
+    int line;
+    int column;
+    std::string message;
+};
+
+// Counters of an extraction, which are always collected as they are cheap. The times are left for the caller to fill in, as it
+// knows what I/O it does.
+struct FxStats {
+    size_t bytesRead = 0;
+    size_t linesRead = 0;
+    size_t bytesWritten = 0;
+    size_t linesWritten = 0;
+    size_t fLiterals = 0;
+    size_t xLiterals = 0;
+    size_t rawLiterals = 0;             // Raw literals of all kinds, including plain R literals.
+    size_t fields = 0;                  // Expression-fields, not counting the nested ones.
+    size_t nestedFields = 0;            // Expression-fields nested in format-specs.
+    size_t debugFields = 0;             // Expression-fields ending in =.
+    size_t lineDirectives = 0;
+    size_t disabledLines = 0;           // Lines of disabled #if groups copied without being lexed.
+    size_t peakOutLines = 0;            // Largest number of bytes of output held back at once.
+    double ioSeconds = 0;
+    double lexSeconds = 0;
+
+    // Aggregate the stats of several extractions.
+    FxStats& operator+=(const FxStats& rhs) {
+        bytesRead += rhs.bytesRead;
+        linesRead += rhs.linesRead;
+        bytesWritten += rhs.bytesWritten;
+        linesWritten += rhs.linesWritten;
+        fLiterals += rhs.fLiterals;
+        xLiterals += rhs.xLiterals;
+        rawLiterals += rhs.rawLiterals;
+        fields += rhs.fields;
+        nestedFields += rhs.nestedFields;
+        debugFields += rhs.debugFields;
+        lineDirectives += rhs.lineDirectives;
+        disabledLines += rhs.disabledLines;
+        peakOutLines = std::max(peakOutLines, rhs.peakOutLines);
+        ioSeconds += rhs.ioSeconds;
+        lexSeconds += rhs.lexSeconds;
+        return *this;
+    }
+};
+
+// An entry of a source map. The output from this position up to the next entry comes from the input from line and column on,
+// line by line. Lines start at 1 and columns at 0. The input column can be negative where the output starts with text which has
+// no input, such as the , before an expression-field first on its line.
+struct FxMapEntry {
+    uint32_t offset;        // Byte offset in the output.
+    uint32_t outLine;
+    uint32_t outColumn;
+    uint32_t line;
+    int32_t column;
+};
+
+struct FxResult {
+    bool ok = true;
+    std::vector<FxDiagnostic> diagnostics;
+    FxStats stats;
+    std::vector<FxMapEntry> sourceMap;      // Only with FxOptions::sourceMap.
+};
+
+// Serialized source map, as written next to output files. The format is a 12 byte header with the characters FXM1 and the
+// number of entries and the length of the source file name as 32 bit little endian integers, then the entries as 5 such integers
+// each, then the source file name. A view of the data, which can be a memory mapped file, translates output positions to input.
+class FxSourceMap {
+public:
+    static std::string serialize(std::string_view sourceFile, const std::vector<FxMapEntry>& entries) {
+        std::string ret = "FXM1";
+        appendWord(ret, uint32_t(entries.size()));
+        appendWord(ret, uint32_t(sourceFile.size()));
+        for (auto& entry : entries) {
+            appendWord(ret, entry.offset);
+            appendWord(ret, entry.outLine);
+            appendWord(ret, entry.outColumn);
+            appendWord(ret, entry.line);
+            appendWord(ret, uint32_t(entry.column));
+        }
+        ret += sourceFile;
+        return ret;
+    }
+
+    // View serialized data, which must outlive this object. Returns false if data is not a source map.
+    bool load(std::string_view data) {
+        if (data.size() < 12 || !data.starts_with("FXM1"))
+            return false;
+
+        size_t count = word(data.data() + 4);
+        size_t nameLength = word(data.data() + 8);
+        if ((data.size() - 12) / 20 < count || data.size() - 12 - count * 20 != nameLength)
+            return false;
+
+        m_entries = data.data() + 12;
+        m_count = count;
+        m_sourceFile = data.substr(12 + count * 20);
+        return true;
+    }
+
+    std::string_view sourceFile() const { return m_sourceFile; }
+    size_t size() const { return m_count; }
+
+    FxMapEntry operator[](size_t ix) const {
+        const char* p = m_entries + ix * 20;
+        return { word(p), word(p + 4), word(p + 8), word(p + 12), int32_t(word(p + 16)) };
+    }
+
+    // The input line and column of an output line and column, all starting at 1. A column of 0, for diagnostics without columns,
+    // stays 0.
+    std::pair<int, int> translate(int line, int column) const {
+        uint32_t col = uint32_t(std::max(column - 1, 0));
+        size_t low = 0;             // Find the last entry at or before the position.
+        size_t high = m_count;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            FxMapEntry entry = (*this)[mid];
+            if (entry.outLine < uint32_t(line) || (entry.outLine == uint32_t(line) && entry.outColumn <= col))
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low == 0)
+            return { line, column };
+
+        FxMapEntry entry = (*this)[low - 1];
+        if (entry.outLine != uint32_t(line) || column == 0)
+            return { int(entry.line) + line - int(entry.outLine), column };
+
+        return { int(entry.line), std::max(entry.column + int(col - entry.outColumn), 0) + 1 };
+    }
+
+private:
+    static void appendWord(std::string& out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out += char(value >> (8 * i));
+    }
+    static uint32_t word(const char* p) {
+        return uint32_t(uint8_t(p[0])) | uint32_t(uint8_t(p[1])) << 8 | uint32_t(uint8_t(p[2])) << 16 | uint32_t(uint8_t(p[3])) << 24;
+    }
+
+    const char* m_entries = nullptr;
+    size_t m_count = 0;
+    std::string_view m_sourceFile;
+};
+
+// Destination of extracted output, which is written in pieces of arbitrary size.
+class FxSink {
+public:
+    virtual ~FxSink() = default;
+    virtual void write(std::string_view data) = 0;
+    virtual void flush() {}         // Called in streaming mode before waiting for more input.
+};
+
+// Sink appending to a caller supplied string.
+class FxStringSink : public FxSink {
+public:
+    explicit FxStringSink(std::string& target) : m_target(target) {}
+    void write(std::string_view data) override { m_target.append(data); }
+
+private:
+    std::string& m_target;
+};
+
+
+class FxExtractor {
+public:
+    class EarlyEnd : public std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+    class ParsingError : public std::runtime_error {
+    public:
+        ParsingError(int lineno, int column, std::string_view msg) : std::runtime_error(std::string(msg)), m_line(lineno), m_column(column) {}
+
+        int line() const { return m_line; }
+        int column() const { return m_column; }
+
+    private:
+        int m_line;
+        int m_column;
+    };
+
+    // Read input line by line from a stream.
+    FxExtractor(FxSink& out, std::istream& inFile, const FxOptions& options) : m_sourceFile(options.sourceFile),
+        m_quotedSourceFile(" \"" + m_sourceFile.string() + "\"\n"), m_functionName(options.functionName),
+        m_lineDirectives(options.lineDirectives), m_compactLines(options.compactLines), m_sourceMap(options.sourceMap), m_maxNesting(options.maxNesting), m_maxErrors(options.maxErrors), m_prefilter(options.prefilter),
+        m_streaming(options.streaming), m_skipDisabled(options.skipDisabled), m_includeResolver(options.includeResolver), m_inFile(&inFile), m_out(out) {
+        defineMacros(options);
+    }
+
+    // Walk an input buffer holding the entire file. The buffer must outlive the extractor.
+    FxExtractor(FxSink& out, std::string_view input, const FxOptions& options) : m_sourceFile(options.sourceFile),
+        m_quotedSourceFile(" \"" + m_sourceFile.string() + "\"\n"), m_functionName(options.functionName),
+        m_lineDirectives(options.lineDirectives), m_compactLines(options.compactLines), m_sourceMap(options.sourceMap), m_maxNesting(options.maxNesting), m_maxErrors(options.maxErrors), m_prefilter(options.prefilter),
+        m_streaming(options.streaming), m_skipDisabled(options.skipDisabled), m_includeResolver(options.includeResolver), m_lineNo(1), m_ptr(input.data()),
+        m_end(input.data() + input.size()), m_lineStart(input.data()), m_out(out) {
+        defineMacros(options);
+    }
+
+    // Conservative check for f/x literals: Does any f or x (in either case) directly precede a " or R"?
+    static bool mayContainFxLiteral(std::string_view input) {
+        const char* begin = input.data();
+        const char* end = begin + input.size();
+        for (const char* quote = findFirstOf<'"'>(begin, end); quote != end; quote = findFirstOf<'"'>(quote + 1, end)) {
+            const char* p = quote;
+            if (p != begin && p[-1] == 'R')
+                p--;
+
+            if (p != begin && ((p[-1] | 0x20) == 'f' || (p[-1] | 0x20) == 'x'))
+                return true;
+        }
+        return false;
+    }
+
+    // True if text is only whitespace and comments, across which literals before and after it are adjacent.
+    static bool isGap(std::string_view text) {
+        bool comment = false;
+        return skipGap(text.data(), text.data() + text.size(), comment) == text.data() + text.size();
+    }
+
+    // Candidate starts of the parts of extractFxChunked, about chunkSize bytes apart, with their line numbers. The first is the start
+    // of input. A line start is preferred if the line before ends in ; { or }, as it is then likely outside literals and comments.
+    static std::vector<std::pair<size_t, int>> splitPoints(std::string_view input, size_t chunkSize) {
+        std::vector<std::pair<size_t, int>> splits = { { 0, 1 } };
+        const char* begin = input.data();
+        const char* end = begin + input.size();
+        const char* prev = begin;
+        int line = 1;
+        chunkSize = std::max<size_t>(chunkSize, 1);
+        while (size_t(end - prev) > chunkSize) {
+            const char* window = prev + std::min(chunkSize + chunkSize / 4, size_t(end - prev));
+            const char* split = nullptr;
+            const char* fallback = nullptr;            // First line start after a line not ending in a backslash.
+            for (const char* ptr = prev + chunkSize; ptr != end; ptr++) {
+                ptr = findFirstOf<'\n'>(ptr, end);
+                if (ptr == end)
+                    break;
+
+                const char* last = ptr;
+                while (last != prev && isspace(last[-1]))
+                    last--;
+                char c = last != prev ? last[-1] : '\0';
+                if (c == ';' || c == '{' || c == '}') {
+                    split = ptr + 1;
+                    break;
+                }
+                if (fallback == nullptr && c != '\\')
+                    fallback = ptr + 1;
+                if (fallback != nullptr && ptr >= window) {
+                    split = fallback;
+                    break;
+                }
+            }
+            if (split == nullptr || split == end)
+                break;
+
+            line += int(countOf<'\n'>(prev, split));
+            splits.emplace_back(size_t(split - begin), line);
+            prev = split;
+        }
+        return splits;
+    }
+
+    // Counters of the extraction so far.
+    const FxStats& stats() const { return m_stats; }
+
+    // The source map entries of the output so far, with FxOptions::sourceMap.
+    std::vector<FxMapEntry>& sourceMap() { return m_map; }
+
+    // Where processPart stopped.
+    const char* position() const { return m_ptr; }
+    int lineNo() const { return m_lineNo; }
+
+    // True if processing stopped at an error, as it was at the end of the input or the FxOptions::maxErrors error. Processing goes
+    // on after other errors, so then position() is still where a part ended.
+    bool stopped() const { return m_stopped; }
+
+    // Process the entire input. Errors are added to diagnostics.
+    bool process(std::vector<FxDiagnostic>& diagnostics) {
+        bool ok = catchErrors(diagnostics, [this] { tryProcess(); });
+
+        // Count lines from the line numbers rather than in an extra pass over the input.
+        if (m_inFile == nullptr && !m_prefiltered)
+            m_stats.linesRead = size_t(m_lineNo - 1) + (m_lineStart != m_end ? 1 : 0);
+        if (m_lastWritten != '\n' && m_lastWritten != '\0')
+            m_stats.linesWritten++;     // The last line has no \n.
+
+        return ok;
+    }
+
+    // Process part of an input buffer for extractFxChunked. The buffer given to the constructor must start at a line start where the
+    // lexer is at top level, outside literals, comments and continued lines, which is on line lineNo. Processing stops at the first
+    // such line start at or after length bytes, see position(). The part at the start of the input gets the initial #line directive.
+    bool processPart(std::vector<FxDiagnostic>& diagnostics, int lineNo, size_t length) {
+        assert(m_inFile == nullptr);
+        const char* start = m_ptr;
+        m_lineNo = lineNo;
+        bool ok = catchErrors(diagnostics, [&] {
+            if (lineNo == 1) {
+                appendLineDirective(1, 0);
+                flushOutLines();
+            }
+            processLines(start + std::min(length, size_t(m_end - start)));
+        });
+
+        // Like process(), the rest of the input counts as read after an error which stopped processing.
+        m_stats.bytesRead = size_t((m_stopped ? m_end : m_ptr) - start);
+        m_stats.linesRead = size_t(m_lineNo - lineNo) + ((m_stopped || m_ptr == m_end) && m_lineStart != m_end ? 1 : 0);
+        return ok;
+    }
+
+    void tryProcess() {
+        std::string outLine;
+
+        if (m_inFile != nullptr) {
+            if (!*m_inFile)
+                throw std::runtime_error("Could not open file.");
+        
+            m_needLine = true;
+        }
+        else
+            m_stats.bytesRead = size_t(m_end - m_ptr);
+
+        appendLineDirective(1, 0);
+        flushOutLines();
+
+        std::string_view input(m_ptr, m_end - m_ptr);
+        bool includes = m_includeResolver && input.find("include") != std::string_view::npos;
+        if (m_prefilter && m_inFile == nullptr && !mayContainFxLiteral(input) && !includes) {
+            size_t newLines = countOf<'\n'>(m_ptr, m_end);
+            m_stats.linesRead = newLines + (input.empty() || input.back() == '\n' ? 0 : 1);
+            m_prefiltered = true;
+            write(input, newLines);      // Nothing to extract: Copy the input in one go.
+            return;
+        }
+
+        processLines(nullptr);
+    }
+
+private:
+    // Run f, adding the errors processing recovered from and any error it throws to diagnostics. Returns false on errors. After an
+    // error which stops processing the rest of the input is output as it is.
+    template<typename F> bool catchErrors(std::vector<FxDiagnostic>& diagnostics, F&& f) {
+        try {
+            f();
+        }
+        catch (const ParsingError& ex) {
+            m_errors.push_back({ ex.line(), ex.column(), ex.what() });
+            m_stopped = true;
+        }
+        catch (const std::runtime_error& ex) {
+            m_errors.push_back({ m_lineNo, column(), ex.what() });
+            m_stopped = true;
+        }
+        if (m_stopped) {
+            dropLiteral();
+            while (!atEnd()) {
+                xferUntil<'\n'>();
+                if (peek() == '\n')
+                    xfer();
+            }
+            flushOutLines();
+        }
+
+        bool ok = m_errors.empty();
+        diagnostics.insert(diagnostics.end(), m_errors.begin(), m_errors.end());
+        m_errors.clear();
+        return ok;
+    }
+
+    // Replace the output of the f/x literal being processed, if any, by its text up to m_ptr. The output of expression-fields
+    // being processed has already been swapped back into place by processExpressionField().
+    void dropLiteral() {
+        if (m_fxDepth > 0) {
+            m_outLines.resize(m_literalOut);
+            while (!m_outMarks.empty() && m_outMarks.back().offset > m_literalOut)
+                m_outMarks.pop_back();
+            m_outLines += m_literalText;
+            m_outLines.append(m_literalBegin, m_ptr);
+        }
+        m_fxDepth = 0;
+        m_literalText.clear();
+        m_rawLiteral = false;
+        m_plainLiterals = 0;
+        m_outStart = 0;
+        m_brackets.clear();
+    }
+
+    // Record the error at line and column and skip to where lexing can likely go on. Returns false if it is the last error to
+    // report, which then stops processing.
+    bool recover(int line, int column, const char* message) {
+        if (int(m_errors.size()) + 1 >= m_maxErrors)
+            return false;
+
+        m_errors.push_back({ line, column, message });
+        bool raw = m_fxDepth > 0 && m_rawLiteral;
+        dropLiteral();
+
+        // A raw literal may span lines, so its end is looked for. Otherwise the rest of the line, with any continuation lines, is
+        // skipped. The text of the dropped literal and the text skipped are output as they are.
+        if (raw) {
+            std::string end = ")" + m_scratch[0].prefix + '"';
+            for (size_t matched = 0; matched < end.size() && !atEnd(); ) {
+                char c = next();
+                m_outLines += c;
+                matched = c == end[matched] ? matched + 1 : c == end[0] ? 1 : 0;
+            }
+            return true;
+        }
+        while (peek() != '\n' && !atEnd()) {
+            if (peek() == '\\')
+                xfer();
+            xfer();
+        }
+        return true;
+    }
+
+    // Process lines up to the end of input or, in buffer mode, up to the first line start at or after limit which is not a
+    // continuation line.
+    void processLines(const char* limit) {
+        bool saved = m_lineDirectives;      // Save m_lineDirectives to be able to restore it at end of line.
+
+        bool continued = false;             // The previous line ended in a backslash.
+        while (!atEnd() && (limit == nullptr || m_ptr < limit || continued || m_plainLiterals != 0)) {        // Process all lines
+            // Scan for string literals, skipping comments. #if groups known to be disabled are skipped if m_skipDisabled is set.
+            bool continuation = false;      // No non-whitespace character since last backslash (i.e. potential continuation line)
+            bool first = true;              // No non-whitespace character since line start (i.e. potential preprocessor directive)
+            bool disabled = false;          // The lines after this conditional directive are disabled.
+            // After an error, lexing resynchronizes and goes on, unless this was the last error to report.
+            while (true) {
+                try {
+                    scanLine(continued, first, continuation, disabled);
+                    break;
+                }
+                catch (const ParsingError& ex) {
+                    if (!recover(ex.line(), ex.column(), ex.what()))
+                        throw;
+                    continuation = false;
+                }
+                catch (const EarlyEnd& ex) {
+                    if (!recover(m_lineNo, column(), ex.what()))
+                        throw;
+                }
+            }
+
+            if (peek() == '\n')             // Preserve lack of last \n char in input.
+                m_outLines += next();
+
+            flushOutLines();
+            if (!continuation) {            // Don't restore if the preprocessor directive continues
+                m_lineDirectives = saved;
+                m_directive = false;
+            }
+            if (disabled)
+                skipDisabledLines();
+
+            continued = continuation;
+        }
+    }
+
+    // Scan a line up to its \n for literals, skipping comments. continued tells if the line continues the previous line, first,
+    // continuation and disabled are the flags of processLines() for the line.
+    void scanLine(bool continued, bool& first, bool& continuation, bool& disabled) {
+        while (peek() != '\n' && !atEnd()) {
+            switch (peek()) {
+            case '"':
+                processStringLiteral();
+                break;
+
+            case '\'':
+                processCharLiteral();
+                break;
+
+            case '/':               // Check for comments.
+                if (peek(1) == '*') {
+                    processCComment();  //  C comments don't need \ last on lines even if this expression is inside a non-raw literal.
+                    break;
+                }
+                else if (peek(1) == '/') {
+                    processCPPComment();  //  C++ comments support \ last on lines regardless of if the enclosing literal is raw or not.
+                    break;
+                }
+                [[fallthrough]];    // No comment start
+
+            case '\\':
+                continuation = true;
+                xfer();
+                break;
+
+            case '#':
+                if (first) {
+                    m_lineDirectives = false;       // This is a preprocessor directive. We can't do #line in them even if enabled.
+                    m_directive = true;
+                    if (m_skipDisabled && !continued)
+                        disabled = conditionalDirective();
+                    if (m_includeResolver && !continued && processInclude())
+                        break;
+                }
+
+                xfer();
+                break;
+                    
+            default: {
+                // Pass everything up to the next character of interest in one go.
+                const char* stop = findFirstOf<'"', '\'', '/', '\\', '#', '\n'>(m_ptr, m_end);
+                for (const char* p = stop; p != m_ptr; ) {
+                    if (!isspace(*--p)) {
+                        first = false; 
+                        continuation = false;
+                        break;
+                    }
+                }
+
+                m_outLines.append(m_ptr, stop);
+                m_ptr = stop;
+            }
+            }
+        }
+    }
+
+    // Descriptor of each expression field including where it starts to be able to add #line directive
+    // ensuring that C++ error messages are appointed to the right position. The expression text is a span of the expressions
+    // string of the LiteralScratch of the literal the field is in.
+    struct Field {
+        int line;
+        int col;
+        size_t offset;
+        size_t length;
+        size_t marksBegin;      // Range of the source map positions of the expression in the expressionMarks of the
+        size_t marksEnd;        // LiteralScratch, which nested f/x literals add.
+    };
+
+    // A source map position recorded by appendLineDirective(), at offset in m_outLines.
+    struct MapMark {
+        size_t offset;
+        int line;
+        int col;
+    };
+
+    // Working storage of an f/x literal being processed. There is one per nesting depth, which is reused for each literal at that
+    // depth so that its capacity is retained, and literals don't allocate once the buffers have grown to fit.
+    struct LiteralScratch {
+        std::string lit;            // Literal text to output, with expressions removed.
+        std::string prefix;         // Raw literal prefix.
+        std::string expressions;    // Text of all expression fields, back to back.
+        std::vector<MapMark> expressionMarks;   // Source map positions in expressions.
+        std::vector<Field> fields;
+        size_t staticLength = 0;    // Length of the text outside the fields, see fxStaticLength().
+
+        std::string_view expression(const Field& field) const { return std::string_view(expressions).substr(field.offset, field.length); }
+    };
+
+    // Read the next line in stream mode. This is done when the line is first peeked at rather than when the \n ending the previous
+    // line is passed, so that in streaming mode all output up to and including that \n can be written before waiting for more input.
+    void readLine() {
+        if (m_fxDepth == 0 && (m_streaming || m_outLines.size() >= flushSize))
+            flushOutLines();
+        if (m_streaming)
+            m_out.flush();
+
+        if (m_fxDepth > 0)
+            m_literalText.append(m_literalBegin, m_end);       // The text of the literal is kept in case it is dropped.
+
+        m_needLine = false;
+        m_lineNo++;
+        if (!getline(*m_inFile, m_inLine))
+            m_inLine.clear();               // The stream may leave the last line in place when it fails.
+        else {
+            m_stats.linesRead++;
+            if (!m_inFile->eof())
+                m_inLine += '\n';
+        }
+        m_stats.bytesRead += m_inLine.size();
+
+        m_ptr = m_inLine.c_str();
+        m_end = m_ptr + m_inLine.size();
+        m_lineStart = m_ptr;
+        m_literalBegin = m_ptr;
+    }
+
+    // In stream mode, read the next line onto the end of m_inLine so that lookahead() can see past the current line. Returns false
+    // at the end of the input.
+    bool appendLine() {
+        if (m_inFile == nullptr || m_needLine || !*m_inFile)
+            return false;
+
+        std::string line;
+        if (!getline(*m_inFile, line))
+            return false;
+
+        m_stats.linesRead++;
+        if (!m_inFile->eof())
+            line += '\n';
+        m_stats.bytesRead += line.size();
+
+        size_t ptr = size_t(m_ptr - m_inLine.data());
+        size_t lineStart = size_t(m_lineStart - m_inLine.data());
+        size_t literalBegin = m_fxDepth > 0 ? size_t(m_literalBegin - m_inLine.data()) : 0;
+        m_inLine += line;
+        m_ptr = m_inLine.data() + ptr;
+        m_end = m_inLine.data() + m_inLine.size();
+        m_lineStart = m_inLine.data() + lineStart;
+        m_literalBegin = m_inLine.data() + literalBegin;
+        return true;
+    }
+
+    // Called when the \n at m_ptr has been passed. In stream mode the next line is read when peeked at, unless already read by
+    // appendLine().
+    void newLine() {
+        m_ptr++;
+        if (m_inFile != nullptr && m_ptr == m_end) {
+            m_needLine = true;
+            return;
+        }
+
+        m_lineNo++;
+        m_lineStart = m_ptr;
+        if (m_fxDepth == 0 && (m_streaming || m_outLines.size() >= flushSize))
+            flushOutLines();
+    }
+
+    // Write m_outLines so far. Only allowed outside f/x literals, where m_outLines can't change anymore. f/x literals can't span
+    // the previous \n, which is the only point where this is done, except in long comments and plain literals. The text after
+    // them, which literal prefix checks look at, is added after the flush. The positions in m_outMarks become source map entries.
+    void flushOutLines() {
+        m_stats.peakOutLines = std::max(m_stats.peakOutLines, m_outLines.size());
+        std::string_view data(m_outLines);
+        size_t from = 0;        // Where the text not yet written starts.
+        for (const MapMark& mark : m_outMarks) {
+            write(data.substr(from, mark.offset - from));
+            FxMapEntry entry{ uint32_t(m_stats.bytesWritten), uint32_t(m_stats.linesWritten + 1), uint32_t(m_stats.bytesWritten - m_writtenLineStart),
+                              uint32_t(mark.line), int32_t(mark.col) };
+            if (!m_map.empty() && m_map.back().offset == entry.offset)
+                m_map.back() = entry;       // Nothing was written since the previous position.
+            else
+                m_map.push_back(entry);
+            from = mark.offset;
+        }
+        write(data.substr(from));
+        m_outLines.clear();
+        m_outMarks.clear();
+    }
+
+    // Write to the sink, counting what is written.
+    void write(std::string_view data) {
+        write(data, countOf<'\n'>(data.data(), data.data() + data.size()));
+    }
+    void write(std::string_view data, size_t newLines) {
+        if (data.empty())
+            return;
+
+        if (m_sourceMap && newLines != 0)
+            m_writtenLineStart = m_stats.bytesWritten + data.rfind('\n') + 1;
+        m_stats.bytesWritten += data.size();
+        m_stats.linesWritten += newLines;
+        m_lastWritten = data.back();
+        m_out.write(data);
+    }
+
+    // Reading past the end of the input gives \0. A \0 in the input is passed like any other character, see atEnd().
+    char peek() { return m_ptr != m_end ? *m_ptr : peekAtEnd(0); }
+    char peek(size_t offset) { return offset < size_t(m_end - m_ptr) ? m_ptr[offset] : peekAtEnd(offset); }
+
+    // Slow path of peek(), reading the next line if needed. In stream mode lines end in \n, which all lookaheads stop at.
+    char peekAtEnd(size_t offset) {
+        if (m_ptr != m_end || !m_needLine)
+            return '\0';
+
+        readLine();
+        return offset < size_t(m_end - m_ptr) ? m_ptr[offset] : '\0';
+    }
+
+    // True at the end of the input, which is told by position as the input may contain \0 characters.
+    bool atEnd() {
+        if (m_ptr != m_end)
+            return false;
+
+        peek();         // Reads the next line in stream mode.
+        return m_ptr == m_end;
+    }
+
+    // True if offset characters after m_ptr is past the end of the input, like atEnd() but for lookahead().
+    bool endAhead(size_t offset) {
+        lookahead(offset);
+        return offset >= size_t(m_end - m_ptr);
+    }
+
+    // The character offset characters after m_ptr. Unlike peek() this can look past the current line: In stream mode the lines
+    // needed are read onto the end of m_inLine. Reading past the end of the input gives \0.
+    char lookahead(size_t offset) {
+        while (offset >= size_t(m_end - m_ptr)) {
+            if (!appendLine())
+                return '\0';
+        }
+        return m_ptr[offset];
+    }
+
+    // Offset of the first of Cs at or after offset from m_ptr, which may be on a later line like for lookahead(). If there is none it is
+    // the offset of the end of the input.
+    template<char... Cs> size_t find(size_t offset) {
+        while (!endAhead(offset)) {
+            const char* ptr = findFirstOf<Cs...>(m_ptr + offset, m_end);
+            offset = size_t(ptr - m_ptr);
+            if (ptr != m_end)
+                break;
+        }
+        return offset;
+    }
+
+    // Consume the current character. The end of input is returned as \n, and not consumed.
+    char next() {
+        char c = peek();
+        if (c == '\n')
+            newLine();
+        else if (m_ptr != m_end)
+            m_ptr++;
+        else
+            return '\n';
+
+        return c;
+    }
+
+    void xfer() {
+        char c = next();
+        m_outLines += c;
+    }
+
+    int column() const { return int(m_ptr - m_lineStart) + 1; }
+
+    bool isspace() { return isspace(peek()); }
+    static bool isspace(char c) { return FxCharClass::isSpace(c); }
+
+    // Transfer characters up to the next one of Cs to the output in one go.
+    template<char... Cs> void xferUntil() {
+        passTo(m_outLines, findFirstOf<Cs...>(m_ptr, m_end));
+    }
+
+    // Move characters up to the next one of Cs to lit in one go. Braces are of interest too in f/x literals.
+    template<char... Cs> void skipToLit(std::string& lit, bool braces) {
+        passTo(lit, braces ? findFirstOf<Cs..., '{', '}'>(m_ptr, m_end) : findFirstOf<Cs...>(m_ptr, m_end));
+    }
+
+    // Append the input up to stop, which is inside a comment or literal, to out. A long run outside f/x literals, where the output
+    // can't change anymore, is written straight from the input instead. Together with the flushes of newLine() and readLine() this
+    // keeps the memory used by big comments and plain literals, like embedded shaders or JSON, from growing with their size.
+    void passTo(std::string& out, const char* stop) {
+        if (m_fxDepth == 0 && &out == &m_outLines && size_t(stop - m_ptr) >= flushSize) {
+            flushOutLines();
+            std::string_view run(m_ptr, size_t(stop - m_ptr));
+            write(run, countOf<'\n'>(run.data(), run.data() + run.size()));
+        }
+        else
+            out.append(m_ptr, stop);
+        m_ptr = stop;
+    }
+
+    // The line the compiler presumes after text which starts on line, taking #line directives of nested literals into account.
+    static int presumedLineAfter(int line, std::string_view text) {
+        size_t directive = text.rfind("\n#line ");
+        if (directive != std::string_view::npos) {
+            std::from_chars(text.data() + directive + 7, text.data() + text.size(), line);
+            text.remove_prefix(text.find('\n', directive + 1) + 1);       // The line after the directive has the given number.
+        }
+        return line + int(countOf<'\n'>(text.data(), text.data() + text.size()));
+    }
+
+    // Append a #line directive to m_outLines, followed by col spaces unless in compact mode. Returns false if line directives are
+    // off. With a source map the position is recorded in m_outMarks instead, which flushOutLines() turns into a map entry.
+    bool appendLineDirective(int line, int col) {
+        if (m_sourceMap) {
+            m_outMarks.push_back({ m_outLines.size(), line, col });
+            return true;
+        }
+        if (!m_lineDirectives)
+            return false;
+        
+        char digits[16];
+        m_stats.lineDirectives++;
+        m_outLines += "\n#line ";
+        m_outLines.append(digits, std::to_chars(digits, digits + sizeof(digits), line).ptr);
+        m_outLines += m_quotedSourceFile;
+        if (!m_compactLines)
+            m_outLines.append(size_t(std::max(col, 0)), ' ');     // col is -1 for a field first on a line.
+
+        return true;
+    }
+
+    // Record the -D and -U macros of options for conditionalDirective. -D without a value defines the macro as 1.
+    void defineMacros(const FxOptions& options) {
+        for (auto& define : options.defines) {
+            size_t eq = define.find('=');
+            if (eq == std::string::npos)
+                m_macros[define] = "1";
+            else
+                m_macros[define.substr(0, eq)] = define.substr(eq + 1);
+        }
+        for (auto& undefine : options.undefines)
+            m_macros[undefine] = std::nullopt;
+    }
+
+    static bool isIfDirective(std::string_view name) { return name == "if" || name == "ifdef" || name == "ifndef"; }
+    static bool isElseDirective(std::string_view name) { return name == "elif" || name == "elifdef" || name == "elifndef" || name == "else"; }
+    static bool isIdentifierChar(char c) { return FxCharClass::isIdentifier(c); }
+
+    // Remove leading whitespace and an identifier from text, returning the identifier. It is empty if there is none.
+    static std::string_view identifier(std::string_view& text) {
+        size_t start = 0;
+        while (start < text.size() && isspace(text[start]))
+            start++;
+        size_t end = start;
+        while (end < text.size() && isIdentifierChar(text[end]))
+            end++;
+
+        std::string_view ret = text.substr(start, end - start);
+        text.remove_prefix(end);
+        return ret;
+    }
+
+    // Handle a preprocessor directive at m_ptr when skipping disabled groups, tracking which #if groups have a branch known to be
+    // taken. Returns true if the lines after the directive are known to be disabled. Conditions which can't be evaluated, as they
+    // use unknown macros or operators not supported by evalCondition, are assumed to be possibly true just like before.
+    bool conditionalDirective() {
+        const char* eol = findFirstOf<'\n'>(m_ptr, m_end);
+        std::string_view line(m_ptr + 1, size_t(eol - m_ptr - 1));
+
+        // Replace comments by spaces. An unterminated /* comment or a continuation line makes the condition unknown.
+        bool reliable = true;
+        size_t last = line.find_last_not_of(" \t\r\f\v");
+        if (last != std::string_view::npos && line[last] == '\\')
+            reliable = false;
+
+        std::string text;
+        for (size_t pos = 0; pos < line.size(); ) {
+            size_t slash = line.find('/', pos);
+            text += line.substr(pos, slash - pos);
+            if (slash == std::string_view::npos || slash + 1 == line.size())
+                break;
+            if (line[slash + 1] == '/')
+                break;
+            if (line[slash + 1] == '*') {
+                size_t close = line.find("*/", slash + 2);
+                if (close == std::string_view::npos) {
+                    reliable = false;
+                    break;
+                }
+                text += ' ';
+                pos = close + 2;
+            }
+            else {
+                text += '/';
+                pos = slash + 1;
+            }
+        }
+
+        std::string_view rest = text;
+        std::string_view name = identifier(rest);
+        if (isIfDirective(name)) {
+            std::optional<long long> value;
+            if (reliable)
+                value = evalDirective(name, rest);
+            m_ifTaken.push_back(value && *value != 0);
+            return value && *value == 0;
+        }
+        if (isElseDirective(name)) {
+            if (m_ifTaken.empty() || !reliable)
+                return false;
+            if (m_ifTaken.back())
+                return true;        // An earlier branch is taken.
+
+            std::optional<long long> value = name == "else" ? 1 : evalDirective(name, rest);
+            m_ifTaken.back() = value && *value != 0;
+            return value && *value == 0;
+        }
+        if (name == "endif") {
+            if (!m_ifTaken.empty())
+                m_ifTaken.pop_back();
+        }
+        else if (name == "define" || name == "undef") {
+            auto iter = m_macros.find(identifier(rest));
+            if (iter != m_macros.end())
+                m_macros.erase(iter);       // The macro is no longer known.
+        }
+        return false;
+    }
+
+    // If the directive at m_ptr is a quoted #include for which m_includeResolver returns a name, output the directive with that name
+    // up to the closing quote and return true.
+    bool processInclude() {
+        const char* eol = findFirstOf<'\n'>(m_ptr, m_end);
+        std::string_view rest(m_ptr + 1, size_t(eol - m_ptr - 1));
+        if (identifier(rest) != "include")
+            return false;
+
+        size_t open = rest.find_first_not_of(" \t");
+        if (open == std::string_view::npos || rest[open] != '"')
+            return false;
+        size_t close = rest.find('"', open + 1);
+        if (close == std::string_view::npos)
+            return false;
+
+        std::string name = m_includeResolver(rest.substr(open + 1, close - open - 1));
+        if (name.empty())
+            return false;
+
+        m_outLines.append(m_ptr, rest.data() + open + 1);
+        m_outLines += name;
+        m_outLines += '"';
+        m_ptr = rest.data() + close + 1;
+        return true;
+    }
+
+    // Evaluate the condition of an #if type directive, or return nullopt if it is unknown.
+    std::optional<long long> evalDirective(std::string_view name, std::string_view condition) const {
+        if (name == "if" || name == "elif")
+            return evalCondition(condition);
+
+        std::optional<long long> value = isDefined(identifier(condition));
+        if (value && name.ends_with("ndef"))
+            *value = !*value;
+        return identifier(condition).empty() && condition.find_first_not_of(" \t\r\f\v") == std::string_view::npos ? value : std::nullopt;
+    }
+
+    std::optional<long long> isDefined(std::string_view name) const {
+        auto iter = m_macros.find(name);
+        if (iter == m_macros.end())
+            return std::nullopt;
+        return iter->second.has_value();
+    }
+
+    // Evaluate a preprocessor expression using the known macros. Only integer literals, macros with such values, defined, !, the
+    // comparison operators, && , || and parentheses are supported. Anything else, or any unknown macro, gives nullopt.
+    std::optional<long long> evalCondition(std::string_view expr) const {
+        std::optional<long long> value = evalOr(expr);
+        return expr.find_first_not_of(" \t\r\f\v") == std::string_view::npos ? value : std::nullopt;
+    }
+
+    // Remove leading whitespace and op from expr if it starts with op.
+    static bool consume(std::string_view& expr, std::string_view op) {
+        size_t start = expr.find_first_not_of(" \t\r\f\v");
+        if (start == std::string_view::npos || expr.substr(start, op.size()) != op)
+            return false;
+
+        expr.remove_prefix(start + op.size());
+        return true;
+    }
+
+    std::optional<long long> evalOr(std::string_view& expr) const {
+        std::optional<long long> lhs = evalAnd(expr);
+        while (consume(expr, "||")) {
+            std::optional<long long> rhs = evalAnd(expr);
+            if ((lhs && *lhs) || (rhs && *rhs))
+                lhs = 1;
+            else if (lhs && rhs)
+                lhs = 0;
+            else
+                lhs = std::nullopt;
+        }
+        return lhs;
+    }
+
+    std::optional<long long> evalAnd(std::string_view& expr) const {
+        std::optional<long long> lhs = evalCompare(expr);
+        while (consume(expr, "&&")) {
+            std::optional<long long> rhs = evalCompare(expr);
+            if (lhs == 0 || rhs == 0)
+                lhs = 0;
+            else if (lhs && rhs)
+                lhs = 1;
+            else
+                lhs = std::nullopt;
+        }
+        return lhs;
+    }
+
+    std::optional<long long> evalCompare(std::string_view& expr) const {
+        std::optional<long long> lhs = evalUnary(expr);
+        for (;;) {
+            int op;
+            if (consume(expr, "=="))
+                op = 0;
+            else if (consume(expr, "!="))
+                op = 1;
+            else if (consume(expr, "<="))
+                op = 2;
+            else if (consume(expr, ">="))
+                op = 3;
+            else if (consume(expr, "<"))
+                op = 4;
+            else if (consume(expr, ">"))
+                op = 5;
+            else
+                return lhs;
+
+            std::optional<long long> rhs = evalUnary(expr);
+            if (!lhs || !rhs)
+                lhs = std::nullopt;
+            else {
+                bool results[] = { *lhs == *rhs, *lhs != *rhs, *lhs <= *rhs, *lhs >= *rhs, *lhs < *rhs, *lhs > *rhs };
+                lhs = results[op];
+            }
+        }
+    }
+
+    std::optional<long long> evalUnary(std::string_view& expr) const {
+        if (consume(expr, "!")) {
+            std::optional<long long> value = evalUnary(expr);
+            return value ? std::optional<long long>(!*value) : std::nullopt;
+        }
+        if (consume(expr, "(")) {
+            std::optional<long long> value = evalOr(expr);
+            return consume(expr, ")") ? value : std::nullopt;
+        }
+
+        std::string_view name = identifier(expr);
+        if (name.empty())
+            return std::nullopt;
+        if (FxCharClass::isDigit(name[0]))
+            return evalNumber(name);
+        if (name == "true" || name == "false")
+            return name == "true";
+        if (name == "defined") {
+            bool paren = consume(expr, "(");
+            std::optional<long long> value = isDefined(identifier(expr));
+            return !paren || consume(expr, ")") ? value : std::nullopt;
+        }
+
+        auto iter = m_macros.find(name);
+        if (iter == m_macros.end())
+            return std::nullopt;
+        if (!iter->second)
+            return 0;       // Undefined macros are 0 in #if.
+        return evalNumber(*iter->second);
+    }
+
+    // Value of an integer literal with an optional suffix, or nullopt if text is something else.
+    static std::optional<long long> evalNumber(std::string_view text) {
+        long long value = 0;
+        int base = 10;
+        if (text.size() > 1 && text[0] == '0') {
+            base = (text[1] | 0x20) == 'x' ? 16 : (text[1] | 0x20) == 'b' ? 2 : 8;
+            text.remove_prefix(base == 8 ? 1 : 2);
+        }
+        auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+        if (ec != std::errc() && !(base == 8 && ptr == text.data()))     // A 0 followed by a suffix has no octal digits.
+            return std::nullopt;
+        for (; ptr != text.data() + text.size(); ptr++) {
+            if ((*ptr | 0x20) != 'u' && (*ptr | 0x20) != 'l')
+                return std::nullopt;
+        }
+        return value;
+    }
+
+    // Update comment for the line from ptr to end of a disabled group, where only comments and quotes are recognized. Unmatched
+    // quotes end at the line end, as compilers don't diagnose them in skipped groups. Returns true if the line ends in a /* comment.
+    static bool scanDisabledLine(const char* ptr, const char* end, bool comment) {
+        while (ptr != end) {
+            if (comment) {
+                ptr = findFirstOf<'*'>(ptr, end);
+                if (ptr == end)
+                    break;
+                if (++ptr != end && *ptr == '/') {
+                    comment = false;
+                    ptr++;
+                }
+                continue;
+            }
+
+            ptr = findFirstOf<'"', '\'', '/'>(ptr, end);
+            if (ptr == end)
+                break;
+            char c = *ptr++;
+            if (c == '/') {
+                if (ptr != end && *ptr == '/')
+                    break;      // The rest of the line is a // comment.
+                if (ptr != end && *ptr == '*') {
+                    comment = true;
+                    ptr++;
+                }
+            }
+            else {
+                while (ptr != end && *ptr != c)
+                    ptr += *ptr == '\\' && ptr + 1 != end ? 2 : 1;
+                if (ptr != end)
+                    ptr++;
+            }
+        }
+        return comment;
+    }
+
+    // Copy the lines of a disabled #if group, up to the #elif, #else or #endif ending it, without lexing them. In buffer mode they
+    // are written in one go.
+    void skipDisabledLines() {
+        const char* blockStart = m_ptr;
+        size_t lines = 0;
+        size_t newLines = 0;
+        int nesting = 0;                    // Depth of nested #if groups in the disabled group.
+        bool comment = false;               // Inside a /* comment.
+        bool continued = false;             // The previous line ended in a backslash.
+        while (!atEnd()) {
+            const char* eol = findFirstOf<'\n'>(m_ptr, m_end);
+            std::string_view line(m_ptr, size_t(eol - m_ptr));
+            size_t hash = line.find_first_not_of(" \t\r\f\v");
+            if (!comment && !continued && hash != std::string_view::npos && line[hash] == '#') {
+                std::string_view rest = line.substr(hash + 1);
+                std::string_view name = identifier(rest);
+                if (isIfDirective(name))
+                    nesting++;
+                else if ((isElseDirective(name) && nesting == 0) || (name == "endif" && nesting-- == 0))
+                    break;
+            }
+
+            comment = scanDisabledLine(m_ptr, eol, comment);
+            size_t last = line.find_last_not_of(" \t\r\f\v");
+            continued = last != std::string_view::npos && line[last] == '\\';
+
+            lines++;
+            if (m_inFile != nullptr) {
+                std::string_view text(m_ptr, size_t(eol - m_ptr) + (eol != m_end ? 1 : 0));     // Written as is, like in buffer mode.
+                m_stats.peakOutLines = std::max(m_stats.peakOutLines, text.size());
+                write(text, eol != m_end ? 1 : 0);
+            }
+            m_ptr = eol;
+            if (peek() == '\n') {
+                newLines++;
+                newLine();
+            }
+        }
+
+        m_stats.disabledLines += lines;
+        if (m_inFile == nullptr)
+            write(std::string_view(blockStart, size_t(m_ptr - blockStart)), newLines);
+    }
+
+    void processCPPComment() {
+        assert(peek() == '/' && peek(1) == '/');
+        xfer();
+        xfer();
+
+        bool backslash = false;     // Set when the last non-whitespace character is a backslash.
+        while (peek() != '\n' || backslash) {            // Comment can have continuation lines...
+            if (atEnd()) {
+                if (backslash)
+                    throw EarlyEnd("Input ends with a // comment line ending in \\.");
+                else
+                    return;     // Comment line last in file. This is ok.
+            }
+            else if (peek() == '\\')
+                backslash = true;
+            else if (peek() == '\n' || !isspace())
+                backslash = false;
+
+            xfer();
+            if (!backslash)
+                xferUntil<'\\', '\n'>();
+        }
+    }
+
+    void processCComment() {
+        assert(peek() == '/' && peek(1) == '*');
+        xfer();
+        xfer();
+        
+        while (peek() != '*' || peek(1) != '/') {
+            if (atEnd())
+                throw EarlyEnd("/* unmatched to the end of the input.");
+
+            xfer();
+            xferUntil<'*', '\n'>();
+        }
+
+        xfer();
+        xfer();
+    }
+
+    // Move char literal starting at s to out without touching any of its contents.
+    void processCharLiteral() { processLiteral(false, '\0', "", '\''); }
+
+    // Length of the encoding prefix of a string literal ending at pos in m_outLines.
+    size_t encodingBefore(size_t pos) const {
+        if (pos <= m_outStart)
+            return 0;
+
+        switch (m_outLines[pos - 1]) {
+        case 'L':
+        case 'U':
+        case 'u':
+            return 1;
+
+        case '8':
+            return pos > m_outStart + 1 && m_outLines[pos - 2] == 'u' ? 2 : 0;
+
+        default:
+            return 0;
+        }
+    }
+
+    // Process a string literal including its prefix. An f/x literal is merged with the string literals adjacent to it, separated
+    // only by whitespace and comments, into one literal followed by all their fields. So are plain literals before it in the run.
+    void processStringLiteral() {
+        bool raw = false;
+        size_t pos = m_outLines.size();
+        if (pos > m_outStart && m_outLines[pos - 1] == 'R') {
+            raw = true;
+            pos--;
+        }
+
+        char fx = 0;
+        std::string encoding;
+        if (pos > m_outStart) {
+            char c = std::tolower(static_cast<unsigned char>(m_outLines[pos - 1]));
+            if (c == 'f' || c == 'x') {
+                fx = c;
+                pos--;
+            }
+
+            // For f literals) we must be able to move the encoding prefix inside the std::format(
+            // call.
+            if (fx == 'f') {
+                encoding = m_outLines.substr(pos - encodingBefore(pos), encodingBefore(pos));
+                pos -= encoding.size();
+            }
+        }
+
+        // A plain literal only has to be looked at if it starts a run containing an f/x literal, which then gets the plain literals
+        // before it including the encoding prefix of the first, which is inside the std::format( call with the rest of the literal.
+        // Otherwise the literal, which has then been found to be well formed, is passed on in one go. The other literals of a run
+        // found not to contain any f/x literal are not looked at again.
+        bool plain = false;
+        if (fx == '\0') {
+            size_t length = std::string_view::npos;
+            if (m_plainLiterals > 0)
+                m_plainLiterals--;
+            else if ((fx = runKind(raw, length)) != '\0') {
+                plain = true;
+                encoding = m_outLines.substr(pos - encodingBefore(pos), encodingBefore(pos));
+                pos -= encoding.size();
+            }
+            else if (length != std::string_view::npos) {
+                passLiteral(raw, length);
+                return;
+            }
+        }
+
+        if (m_fxDepth == 0) {       // Where the text of the literal starts, in case it is dropped at an error.
+            m_literalBegin = m_ptr - (m_outLines.size() - pos);
+            m_literalOut = pos;
+            m_literalText.clear();
+        }
+        m_outLines.erase(pos);
+        processLiteral(raw, fx, encoding, '"', plain);
+    }
+
+    // Pass the plain literal of length characters at m_ptr, which is known to end properly, to the output. The R of a raw literal
+    // is already there.
+    void passLiteral(bool raw, size_t length) {
+        if (raw)
+            m_stats.rawLiterals++;
+
+        const char* end = m_ptr + length;
+        size_t newLines = countOf<'\n'>(m_ptr, end);
+        if (newLines != 0) {
+            m_lineNo += int(newLines);
+            m_lineStart = end;
+            while (m_lineStart[-1] != '\n')
+                m_lineStart--;
+        }
+        passTo(m_outLines, end);
+    }
+
+    // Where a string literal adjacent to the one before starts, as found by nextLiteral().
+    struct LiteralStart {
+        size_t gap = 0;             // Length of the whitespace and comments before it.
+        size_t encoding = 0;        // Length of its encoding prefix.
+        size_t length = 0;          // Length of its prefix up to the opening quote.
+        char fx = '\0';
+        bool raw = false;
+    };
+
+    // The string literal separated only by whitespace and comments from the literal ending offset characters after m_ptr, if any.
+    // A literal directly followed by an identifier has a ud-suffix instead. In preprocessor directives the literals must be on the
+    // same line, as a line end which isn't escaped ends the directive.
+    std::optional<LiteralStart> nextLiteral(size_t offset) {
+        LiteralStart ret;
+        ret.gap = gapLength(offset);
+        size_t pos = offset + ret.gap;
+        if (ret.gap == 0 && FxCharClass::isIdentifier(lookahead(pos)))
+            return std::nullopt;
+        if (m_directive) {
+            for (size_t i = offset; i < pos; i++) {
+                if (lookahead(i) == '\n')
+                    return std::nullopt;
+            }
+        }
+
+        char c = lookahead(pos);
+        if (c == 'u' && lookahead(pos + 1) == '8')
+            ret.encoding = 2;
+        else if (c == 'u' || c == 'U' || c == 'L')
+            ret.encoding = 1;
+        pos += ret.encoding;
+
+        c = std::tolower(static_cast<unsigned char>(lookahead(pos)));
+        if (c == 'f' || c == 'x') {
+            ret.fx = c;
+            pos++;
+        }
+        if (lookahead(pos) == 'R') {
+            ret.raw = true;
+            pos++;
+        }
+        if (lookahead(pos) != '"')
+            return std::nullopt;
+
+        ret.length = pos - offset - ret.gap;
+        return ret;
+    }
+
+    // If the plain string literal at m_ptr, raw or not, starts a run of adjacent literals containing an f/x literal return the kind of
+    // the first one. Otherwise set m_plainLiterals to the number of other literals in the run. length is set to the length of the
+    // literal at m_ptr, unless it doesn't end properly.
+    char runKind(bool raw, size_t& length) {
+        size_t offset = 0;          // Of the opening quote of the current literal.
+        size_t literals = 0;
+        while (true) {
+            size_t end = literalEnd(offset, raw);
+            if (end == std::string_view::npos)
+                break;          // The error is reported when the literal is processed.
+            if (offset == 0)
+                length = end;
+
+            std::optional<LiteralStart> start = nextLiteral(end);
+            if (!start)
+                break;
+            if (start->fx != '\0')
+                return start->fx;
+
+            literals++;
+            offset = end + start->gap + start->length;
+            raw = start->raw;
+        }
+        m_plainLiterals = literals;
+        return '\0';
+    }
+
+    // The offset after the closing quote of the string literal whose opening quote is offset characters after m_ptr, or npos if it
+    // doesn't end where processLiteral would accept it.
+    size_t literalEnd(size_t offset, bool raw) {
+        size_t pos = offset + 1;
+        if (raw) {
+            std::string delimiter = ")";
+            for (char c = lookahead(pos); c != '('; c = lookahead(++pos)) {
+                if ((c == '\0' && endAhead(pos)) || c == '\n')
+                    return std::string_view::npos;
+                delimiter += c;
+            }
+            delimiter += '"';
+
+            while (true) {
+                pos = find<')'>(pos);
+                if (endAhead(pos))
+                    return std::string_view::npos;
+
+                size_t match = 1;
+                while (match < delimiter.size() && lookahead(pos + match) == delimiter[match])
+                    match++;
+                if (match == delimiter.size())
+                    return pos + match;
+                pos++;
+            }
+        }
+
+        bool backslash = false;
+        while (true) {
+            if (!backslash)
+                pos = find<'"', '\\', '\n'>(pos);
+
+            char c = lookahead(pos++);
+            if (c == '\\')
+                backslash = !backslash;
+            else if (c == '"' && !backslash)
+                return pos;
+            else if ((c == '\0' && endAhead(pos - 1)) || (c == '\n' && !backslash))
+                return std::string_view::npos;
+            else if (c == '\n' || !isspace(c))
+                backslash = false;
+        }
+    }
+
+    // Length of the whitespace and comments offset characters after m_ptr. A // comment continued by a backslash isn't included.
+    size_t gapLength(size_t offset) {
+        bool comment = false;
+        size_t pos = offset;
+        while (true) {
+            lookahead(pos);         // Reads the line pos is on in stream mode.
+            const char* stop = skipGap(m_ptr + pos, m_end, comment);
+            pos = size_t(stop - m_ptr);
+            if (stop != m_end || endAhead(pos))
+                return pos - offset;
+        }
+    }
+
+    // The first character from ptr on which is not whitespace or in a comment. On entry and exit comment tells if ptr is inside a
+    // /* comment. Returns end if all of it is.
+    static const char* skipGap(const char* ptr, const char* end, bool& comment) {
+        while (ptr != end) {
+            if (comment) {
+                ptr = findFirstOf<'*'>(ptr, end);
+                if (ptr == end || ++ptr == end)
+                    return end;
+                if (*ptr == '/') {
+                    comment = false;
+                    ptr++;
+                }
+            }
+            else if (isspace(*ptr))
+                ptr++;
+            else if (*ptr != '/' || ptr + 1 == end)
+                return ptr;
+            else if (ptr[1] == '*') {
+                comment = true;
+                ptr += 2;
+            }
+            else if (ptr[1] == '/') {
+                const char* eol = findFirstOf<'\n'>(ptr, end);
+                const char* last = eol;
+                while (last != ptr && isspace(last[-1]))
+                    last--;
+                if (last[-1] == '\\')
+                    return ptr;
+                ptr = eol;
+            }
+            else
+                return ptr;
+        }
+        return end;
+    }
+
+    // Process a char or string literal according to raw mode, f/x mode and terminator, prepending encoding where appropriate. An
+    // f/x literal is merged with the adjacent string literals after it, see processStringLiteral(). With plain the literal is a
+    // plain literal starting a run where the first f/x literal is of kind fx.
+    void processLiteral(bool raw, char fx, const std::string& encoding, char terminator, bool plain = false) {
+        assert(peek() == terminator);
+
+        // Non-f/x literals are passed straight to m_outLines, as their contents are never moved.
+        if (fx == '\0') {
+            std::string prefix;
+            processLiteralText(raw, '\0', terminator, m_outLines, prefix, nullptr);
+            return;
+        }
+
+        int startLine = m_lineNo;
+
+        // Each nested f/x literal recurses through the functions processing its expression-fields. Brackets and ?: don't.
+        if (m_fxDepth >= m_maxNesting)
+            throw ParsingError(m_lineNo, column(), std::format("f/x literals are nested more than {} deep.", m_maxNesting));
+
+        // f/x literals are collected in the scratch storage of their nesting depth. Note: The deque keeps references to the outer
+        // levels valid when it grows.
+        if (size_t(m_fxDepth) == m_scratch.size())
+            m_scratch.emplace_back();
+
+        LiteralScratch& scratch = m_scratch[m_fxDepth];
+        std::string& lit = scratch.lit;
+        lit.clear();
+        scratch.expressions.clear();
+        scratch.expressionMarks.clear();
+        scratch.fields.clear();
+        scratch.staticLength = 0;
+        m_fxDepth++;
+
+        // Process each literal of the run, with the whitespace and comments between them.
+        lit += encoding;
+        char kind = plain ? '\0' : fx;
+        while (true) {
+            if (kind != '\0')
+                (kind == 'f' ? m_stats.fLiterals : m_stats.xLiterals)++;
+            processLiteralText(raw, kind, terminator, lit, scratch.prefix, &scratch);
+
+            std::optional<LiteralStart> start = nextLiteral(0);
+            if (!start)
+                break;
+
+            for (size_t i = 0; i < start->gap; i++)
+                lit += next();
+            if (start->fx != '\0' && start->fx != fx)
+                throw ParsingError(m_lineNo, column(), "f and x literals can't be adjacent.");
+
+            lit.append(m_ptr, start->encoding);
+            m_ptr += start->length;
+            raw = start->raw;
+            kind = start->fx;
+        }
+
+        // Output the std::format( for f literals only
+        if (fx == 'f') {
+            if (m_functionName.ends_with("**")) {
+                m_outLines.append(m_functionName, 0, m_functionName.size() - 2);
+                m_outLines += '<';
+                m_outLines += std::to_string(scratch.fields.size());
+                m_outLines += ", ";
+                m_outLines += std::to_string(scratch.staticLength);
+                m_outLines += '>';
+            }
+            else if (m_functionName.back() == '*') {
+                m_outLines.append(m_functionName, 0, m_functionName.size() - 1);
+                m_outLines += '<';
+                m_outLines += std::to_string(scratch.fields.size());
+                m_outLines += '>';
+            }
+            else
+                m_outLines += m_functionName;
+
+            m_outLines += '(';
+        }
+
+        m_outLines += lit;
+
+        // Emit all extracted field expressions preceded by #line directives for their input positions, in compact mode only when
+        // the line presumed by the compiler differs. The presumed line is the input line outside and at the start of literals.
+        int presumedLine = presumedLineAfter(startLine, lit);
+        for (auto& field : scratch.fields) {
+            if ((!m_compactLines || m_sourceMap || presumedLine != field.line) && appendLineDirective(field.line, field.col - 2))   // Subtract 2 for the , we add before the field below.
+                presumedLine = field.line;
+
+            std::string_view expression = scratch.expression(field);
+            m_outLines += ", ";
+            for (size_t i = field.marksBegin; i < field.marksEnd; i++) {
+                MapMark mark = scratch.expressionMarks[i];
+                mark.offset = mark.offset - field.offset + m_outLines.size();
+                m_outMarks.push_back(mark);
+            }
+            m_outLines += expression;
+            presumedLine = presumedLineAfter(presumedLine, expression);
+        }
+
+        if (fx == 'f')
+            m_outLines += ")";
+
+        // Get back in sync if the literal spans lines after its last field. A source map also gets the column after the literal.
+        if (presumedLine != m_lineNo || m_sourceMap)
+            appendLineDirective(m_lineNo, int(m_ptr - m_lineStart));
+
+        m_fxDepth--;
+    }
+
+    // Pass one literal from its opening quote, or the R before it, to lit. In an f/x literal, which is the case if scratch is set,
+    // fields are extracted to scratch, and the braces of a plain literal merged into it are doubled. fx is the kind of the literal.
+    void processLiteralText(bool raw, char fx, char terminator, std::string& lit, std::string& prefix, LiteralScratch* scratch) {
+        if (raw)
+            m_stats.rawLiterals++;
+
+        auto toLit = [&] {
+            lit += next();
+        };
+
+        // Handle start of literal
+        if (raw) {
+            lit += 'R';
+            toLit();
+            
+            // Collect prefix
+            prefix.clear();
+            while (peek() != '(') {
+                if (atEnd() || peek() == '\n')
+                    throw ParsingError(m_lineNo, column(), " ends in a raw literal prefix. There must be a ( before the end of line after R\".");
+
+                prefix += next();
+            }
+            lit += prefix;
+            toLit();
+        }
+        else
+            toLit();         // add quote
+
+        // Process the actual literal contents. An error in the outermost f/x literal resynchronizes at its end if it is raw.
+        if (scratch == &m_scratch[0])
+            m_rawLiteral = raw;
+        size_t contentStart = lit.size();
+        bool braces = scratch != nullptr;
+        bool backslash = false;         // Only used in non-raw case
+        while (true) {
+            if (raw) {      // Pass raw line ends and try to find prefix
+                skipToLit<')', '\n'>(lit, braces);
+                if (atEnd())
+                    throw EarlyEnd("Input ends in raw literal.");
+
+                if (peek() == ')') {       // Look for prefix after ) and " after that.
+                    size_t pix = 0;
+                    while (pix < prefix.size()) {
+                        if (peek(pix + 1) != prefix[pix])   // Note: as prefix can't contain \n or \0 we can always pre-see characters until comparison fails or prefix is complete.
+                            break;
+                        
+                        pix++;
+                    }
+                    if (pix == prefix.size() && peek(pix + 1) == terminator)
+                        break;      // Raw literal ended
+                }
+            }
+            else {      // Handle continuation lines and escaped quotes in non-raw literals
+                if (!backslash && terminator == '"')
+                    skipToLit<'"', '\\', '\n'>(lit, braces);
+
+                if (peek() == '\\')
+                    backslash = !backslash;
+                else if (peek() == terminator) {
+                    if (backslash)
+                        backslash = false;
+                    else
+                        break;          // Literal ended
+                }
+                else if (atEnd())
+                    throw EarlyEnd("Input ends inside a char or string literal.");
+                else if (!backslash && peek() == '\n')
+                    throw ParsingError(m_lineNo, column(), "Input line ends inside a char or string literal.");
+                else if (peek() == '\n' || !isspace())
+                    backslash = false;
+            }
+            
+            if (fx != '\0') {
+                if (peek() == '{') {
+                    next();
+                    if (peek() != '{')
+                        processExtractionField(*scratch);
+                    else
+                        lit += '{';   // The first { transferred for double left braces. The second is transferred as the "normal" literal character.
+                }
+                else if (peek() == '}') {
+                    toLit();      // Transfer the first } to the resulting string
+                    if (peek() != '}')
+                        throw ParsingError(m_lineNo, column(), "Right brace characters must be doubled in f/x string literals.");
+                }
+            }
+            else if (braces && (peek() == '{' || peek() == '}'))
+                lit += peek();      // Braces of plain literals in f/x literals are text.
+
+            toLit();      // A regular literal character
+        }
+
+        if (scratch != nullptr)
+            scratch->staticLength += fxStaticLength(std::string_view(lit).substr(contentStart));
+        if (scratch == &m_scratch[0])
+            m_rawLiteral = false;
+
+        if (raw) {
+            toLit();  // The )
+            lit += prefix;
+            m_ptr += prefix.size();
+        }
+        toLit();      // Transfer the ending quote
+    }
+
+    // Parse an extraction field and add its contained expression(s) to the fields of scratch. Add the remaining literal part such
+    // as {} or {:xxx} to its lit.
+    void processExtractionField(LiteralScratch& scratch) {
+        std::string& lit = scratch.lit;
+        Field field = processExpressionField(scratch.expressions, scratch.expressionMarks);
+        // Check for expression-field ending in = +optional spaces.
+        std::string_view expression = scratch.expression(field);
+        size_t pos = expression.size();
+        while (pos > 0 && isspace(expression[pos - 1]))
+            pos--;
+
+        if (pos > 0 && expression[pos - 1] == '=') {  // Debug style field where expression ends in =
+            lit += expression;
+            field.length = pos - 1;     // Remove = and trailing spaces from field.
+            m_stats.debugFields++;
+        }
+
+        lit += '{';     // After automatically generated label, if any.
+
+        auto toLit = [&] {
+            lit += next();
+        };
+
+        scratch.fields.push_back(field);
+        m_stats.fields++;
+        // If : check for nested fields in the format-spec
+        if (peek() == ':') {
+            toLit();      // Transfer the : to the resulting string
+            while (peek() != '}') {
+                if (atEnd())
+                    throw EarlyEnd("Input ends inside format-spec");
+
+                if (peek() == '{') {    // Nested field starts
+                    toLit();
+
+                    // Find the end of the expression-field. Basically scan for : or } but ignore as many colons as there are ? and
+                    // skip through all parentheses, except in string literals.
+                    Field field = processExpressionField(scratch.expressions, scratch.expressionMarks);
+                    if (peek() != '}')   // Colon not allowed inside nested expression-field.
+                        throw ParsingError(m_lineNo, column(), "Found nested expression-field ending in :. This is not allowed.");
+
+                    scratch.fields.push_back(field);
+                    m_stats.nestedFields++;
+                }
+
+                toLit();      // Transfer other formatting argument char to the resulting string
+            }
+        }
+    }
+    
+    // Parse a top level part of an expression field until a colon or right brace is encountered. Ignore double colons, pass over
+    // nested brackets and ?: ternaries.
+    // Pre: just after {
+    // Post: peek() == '}' or ':'
+    // The expression text is appended to expressions, which is swapped in as m_outLines meanwhile so that everything transferred
+    // ends up there without copying, and likewise the source map positions of nested literals to marks. m_outStart keeps literal
+    // prefix checks from looking into the previous expression. All are restored also when an error unwinds, so that recover()
+    // finds the output before the literal in m_outLines.
+    Field processExpressionField(std::string& expressions, std::vector<MapMark>& marks) {
+        Field ret;            // Field to return
+        ret.line = m_lineNo;
+        ret.col = int(m_ptr - m_lineStart);
+        ret.offset = expressions.size();
+        ret.marksBegin = marks.size();
+
+        struct Swap {
+            FxExtractor& extractor;
+            std::string& expressions;
+            std::vector<MapMark>& marks;
+            size_t saveStart;
+            ~Swap() {
+                extractor.m_outStart = saveStart;
+                std::swap(extractor.m_outLines, expressions);
+                std::swap(extractor.m_outMarks, marks);
+            }
+        };
+        std::swap(m_outLines, expressions);
+        std::swap(m_outMarks, marks);
+        {
+            Swap swap{ *this, expressions, marks, std::exchange(m_outStart, ret.offset) };
+            processExpression();
+        }
+        ret.length = expressions.size() - ret.offset;
+        ret.marksEnd = marks.size();
+        return ret;
+    }
+
+    // The colon of each ? passed is expected before the field ends, and a colon after that ends it. Counting the ? matches each colon
+    // to the innermost ? before it, as in a ? b ? c : d : e.
+    void processExpression()
+    {
+        size_t ternaries = 0;           // Number of ? without their :.
+        while (true) {
+            processNested();
+
+            switch (peek()) {
+            case ')':
+                throw ParsingError(m_lineNo, column(), "Extraneous ) in expression-field");
+
+            case ']':
+                throw ParsingError(m_lineNo, column(), "Extraneous ] in expression-field");
+                break;
+
+            case '?':
+                xfer();
+                ternaries++;
+                break;
+
+            case '}':
+                if (ternaries != 0)
+                    throw ParsingError(m_lineNo, column(), "Mismatched ? in expression-field");
+                return;
+                
+            case ':':
+                if (peek(1) != ':' || !FxCharClass::isAlpha(peek(2))) {
+                    if (ternaries == 0)
+                        return;
+
+                    ternaries--;
+                    xfer();      // Pass the : of a ?
+                    break;
+                }
+
+                xfer();
+                xfer();
+                break;
+                
+            default:
+                xfer();     // Nothing to do for other characters, pass them up to the next one of interest.
+                xferUntil<'(', '[', '{', ')', ']', '}', '?', ':', '"', '\'', '/', '\n'>();
+                break;
+            }
+        }
+    }
+
+    // Pass over any number of nested comments, literals and matched parentheses, returning the text passed over, which may span lines.
+    // Note: This helper must work on an existing 'ret' as processStringLiteral does so to be able to check for prefixes in the
+    // already passed text. Fortunately prefixes are not allowed to span lines.
+    void processNested()
+    {
+        while (true) {
+            processCommentsAndLiterals();
+            if (!FxCharClass::isOpening(peek()))
+                return;
+
+            processNestedParenthesis();
+        }
+    }
+
+    // Pass over any number of comments and literals in an expression-field.
+    void processCommentsAndLiterals()
+    {
+        while (true) {
+            if (atEnd())
+                throw EarlyEnd("Input ends inside an expression-field in a literal.");
+
+            switch (peek()) {
+            case '"':
+                processStringLiteral();
+                break;
+
+            case '\'':
+                processCharLiteral();
+                break;
+
+            case '/':               // Check for comments.
+                if (peek(1) == '*') {
+                    processCComment();  //  C comments don't need \ last on lines even if this expression is inside a non-raw literal.
+                    break;
+                }
+                else if (peek(1) == '/') {
+                    processCPPComment();  //  C++ comments support \ last on lines regardless of if the enclosing literal is raw or not.
+                    if (atEnd())
+                        throw EarlyEnd("Input ends with a // comment inside a expression-field");
+                }
+                else
+                    return;         // A division operator, which the caller passes.
+                break;
+
+            default:
+                return;
+            }
+        }
+    }
+
+    // Pass over a bracket and everything up to its matching closing bracket. Nested brackets are tracked on m_brackets, which holds
+    // the closing bracket expected at each level. Literals in the brackets can contain expression-fields with brackets of their own,
+    // which start their levels above those of this call.
+    void processNestedParenthesis() {
+        assert(FxCharClass::isOpening(peek()));
+        size_t base = m_brackets.size();
+        do {
+            char c = peek();
+            xfer();
+            if (FxCharClass::isOpening(c))
+                m_brackets += FxCharClass::partner(c);
+            else if (c == m_brackets.back())
+                m_brackets.pop_back();
+            else if (FxCharClass::isClosing(c)) {
+                char expected = m_brackets.back();
+                m_brackets.resize(base);
+                throw ParsingError(m_lineNo, column(), std::format("Mismatched {}. A {} was found where a {} was expected.", FxCharClass::partner(expected), c, expected));
+            }
+            else
+                xferUntil<'(', '[', '{', ')', ']', '}', '"', '\'', '/', '\n'>();
+
+            if (m_brackets.size() > base)
+                processCommentsAndLiterals();
+        } while (m_brackets.size() > base);
+    }
+
+    std::filesystem::path m_sourceFile;    // Path to file being compiled
+    std::string m_quotedSourceFile;        // The end of #line directives: The quoted m_sourceFile and a newline.
+    std::string m_functionName;            // Name of function to wrap f-literals in.
+    bool m_lineDirectives;                 // True to output line directives. Set false in most unit tests.
+    bool m_compactLines = false;           // True to only output line directives where the line number would be wrong, without padding.
+    bool m_sourceMap = false;              // True to collect m_map instead of outputting line directives.
+    int m_maxNesting;                      // Most f/x literals nested in each other.
+    int m_maxErrors;                       // Most errors to report.
+    bool m_prefilter = false;              // True to copy input buffers which can't contain f/x literals verbatim.
+
+    bool m_streaming = false;              // True to write output as soon as possible.
+    bool m_skipDisabled = false;           // True to copy disabled #if groups without lexing them.
+    std::map<std::string, std::optional<std::string>, std::less<>> m_macros;   // Known macros: Their values, or nullopt if undefined.
+    std::vector<bool> m_ifTaken;           // For each enclosing #if group: True if a branch of it is known to be taken.
+    std::function<std::string(std::string_view name)> m_includeResolver;    // Renames quoted #includes, if set.
+
+    std::istream* m_inFile = nullptr;   // Input stream, or nullptr when walking an input buffer.
+    bool m_needLine = false;        // Stream mode: The \n ending m_inLine has been passed, read the next line when peeked at.
+    std::string m_inLine;           // Current line in input stream
+    int m_lineNo = 0;               // Line number (starts on 1)
+    const char* m_ptr = nullptr;    // Pointer to current character.
+    const char* m_end = nullptr;    // End of input buffer or of m_inLine.
+    const char* m_lineStart = nullptr;  // Start of the current line, for column numbers.
+
+    FxSink& m_out;                  // Output sink.
+    char m_lastWritten = '\0';      // Last character written, to count a last line without \n.
+    size_t m_writtenLineStart = 0;  // Offset of the start of the last line written, for source map columns.
+    std::vector<FxMapEntry> m_map;  // Source map entries of the output written.
+    bool m_prefiltered = false;     // The input was copied without being walked.
+    FxStats m_stats;
+    int m_fxDepth = 0;              // Number of f/x literals being processed, which are output when complete.
+    std::string m_outLines;         // Current output lines. Except inside multi-line literals or comments this is always just one line
+    static constexpr size_t flushSize = 64 * 1024;     // Size of m_outLines above which it is written in comments and plain literals.
+    std::vector<MapMark> m_outMarks;    // Source map positions in m_outLines, in order.
+    size_t m_outStart = 0;          // Start of the text of the current expression-field in m_outLines.
+    std::deque<LiteralScratch> m_scratch;   // Working storage for each f/x literal nesting depth.
+    std::string m_brackets;         // Closing brackets expected by processNestedParenthesis, innermost last.
+    size_t m_plainLiterals = 0;     // Number of literals left of a run of adjacent plain literals, see processStringLiteral().
+    bool m_directive = false;       // In a preprocessor directive.
+    bool m_rawLiteral = false;      // The text of a raw literal on the outermost f/x literal nesting depth is being processed.
+    const char* m_literalBegin = nullptr;   // Input text of the outermost f/x literal being processed, including its prefix, with
+    std::string m_literalText;              // the text on earlier lines in m_literalText in stream mode. Output as it is if
+    size_t m_literalOut = 0;                // dropped at an error, replacing m_outLines from m_literalOut on.
+    std::vector<FxDiagnostic> m_errors;     // Errors recovered from, and the one which stopped processing.
+    bool m_stopped = false;         // Processing stopped at an error.
+};
+
+
+// Extract f/x literals in source, appending the result to output.
+inline FxResult extractFx(std::string_view source, FxSink& output, const FxOptions& options = {})
+{
+    FxResult result;
+    FxExtractor extractor(output, source, options);
+    result.ok = extractor.process(result.diagnostics);
+    result.stats = extractor.stats();
+    result.sourceMap = std::move(extractor.sourceMap());
+    return result;
+}
+
+inline FxResult extractFx(std::string_view source, std::string& output, const FxOptions& options = {})
+{
+    FxStringSink sink(output);
+    return extractFx(source, sink, options);
+}
+
+// Extract source like extractFx, appending the same output to output, but in parts of about chunkSize bytes which can be processed
+// concurrently. run is called with a task per part, and must run all of them, on any threads, before returning. The parts start at
+// line starts which are likely to be outside literals and comments. A part which turns out not to start where the previous part
+// stopped started in the wrong lexer state, and is processed again from there after the concurrent ones.
+template<typename Run> FxResult extractFxChunked(std::string_view source, std::string& output, const FxOptions& options, size_t chunkSize, Run&& run)
+{
+    // #if groups and the includes to follow depend on the input before, a prefiltered input is copied in one go, and source map
+    // positions are those of the whole output.
+    if (options.skipDisabled || options.includeResolver || options.streaming || options.sourceMap || (options.prefilter && !FxExtractor::mayContainFxLiteral(source)))
+        return extractFx(source, output, options);
+
+    struct Part {
+        size_t begin;
+        size_t limit;
+        int lineNo;
+        std::string output{};
+        std::vector<FxDiagnostic> diagnostics{};
+        int maxErrors = 0;
+        bool stopped = false;
+        size_t end = 0;
+        int endLineNo = 0;
+        FxStats stats{};
+    };
+
+    std::vector<std::pair<size_t, int>> splits = FxExtractor::splitPoints(source, chunkSize);
+    std::vector<Part> parts;
+    for (size_t i = 0; i < splits.size(); i++)
+        parts.push_back({ splits[i].first, i + 1 < splits.size() ? splits[i + 1].first : source.size(), splits[i].second });
+
+    // A part is processed with at most maxErrors errors, which are those left to report.
+    auto process = [&](Part& part, int maxErrors) {
+        FxStringSink sink(part.output);
+        FxOptions partOptions = options;
+        partOptions.maxErrors = maxErrors;
+        FxExtractor extractor(sink, source.substr(part.begin), partOptions);
+        extractor.processPart(part.diagnostics, part.lineNo, part.limit - part.begin);
+        part.maxErrors = maxErrors;
+        part.stopped = extractor.stopped();
+        part.end = size_t(extractor.position() - source.data());
+        part.endLineNo = extractor.lineNo();
+        part.stats = extractor.stats();
+    };
+
+    std::vector<std::function<void()>> tasks;
+    for (auto& part : parts)
+        tasks.push_back([&process, &part, &options] { process(part, options.maxErrors); });
+    run(tasks);
+
+    FxResult result;
+    size_t pos = 0;
+    int lineNo = 1;
+    char lastWritten = '\0';
+    for (auto& part : parts) {
+        // Process again from the right place, or if the errors before leave fewer errors to report than the part found.
+        int maxErrors = options.maxErrors - int(result.diagnostics.size());
+        if (part.begin != pos || (part.maxErrors != maxErrors && int(part.diagnostics.size()) >= maxErrors)) {
+            part = { pos, std::max(part.limit, pos), lineNo };
+            process(part, maxErrors);
+        }
+
+        output += part.output;
+        if (!part.output.empty())
+            lastWritten = part.output.back();
+        result.diagnostics.insert(result.diagnostics.end(), part.diagnostics.begin(), part.diagnostics.end());
+        result.ok = result.diagnostics.empty();
+        result.stats += part.stats;
+        if (part.stopped)
+            break;
+        pos = part.end;
+        lineNo = part.endLineNo;
+    }
+
+    if (lastWritten != '\n' && lastWritten != '\0')
+        result.stats.linesWritten++;     // The last line has no \n.
+    return result;
+}
+
+// Extraction of a source which is edited, for IDEs keeping an extracted view current. The source is extracted in parts of about
+// chunkSize bytes, and where each part starts, at a line start with the lexer at top level, a checkpoint is kept. After an edit the
+// parts are extracted again from the last checkpoint before the edit until a part ends at one of the old checkpoints after the
+// edit, from where on the old output is kept. The output is the same as from extractFx without the prefilter. With #line directives
+// line numbers in the old output would be wrong after an edit adding or removing lines, so then everything after the edit is
+// extracted again. With skipDisabled or an includeResolver, which depend on all lines before, the whole source is extracted again.
+class FxIncrementalExtractor {
+public:
+    // The parts of the output and source map which edit() changed. The output from outputBegin to outputEnd replaced removedOutput
+    // bytes, and the sourceMap() entries from mapBegin to mapEnd replaced removedEntries entries. The entries after them are the
+    // old ones, moved to their new positions in the output.
+    struct Change {
+        size_t outputBegin = 0;
+        size_t outputEnd = 0;
+        size_t removedOutput = 0;
+        size_t mapBegin = 0;
+        size_t mapEnd = 0;
+        size_t removedEntries = 0;
+    };
+
+    FxIncrementalExtractor(std::string source, const FxOptions& options, size_t chunkSize = 4096) : m_source(std::move(source)),
+        m_options(options), m_chunkSize(std::max<size_t>(chunkSize, 1)), m_restartAtStart(options.skipDisabled || options.includeResolver) {
+        m_options.prefilter = false;
+        m_options.streaming = false;
+        m_checkpoints.push_back({ 0, 1, 0, 0, 0 });
+        extractFrom(0, 1, 0);
+    }
+
+    // Replace length bytes of the source at offset by text and extract it again where needed.
+    Change edit(size_t offset, size_t length, std::string_view text) {
+        assert(offset <= m_source.size() && length <= m_source.size() - offset);
+        std::string_view removed = std::string_view(m_source).substr(offset, length);
+        ptrdiff_t shift = ptrdiff_t(text.size()) - ptrdiff_t(length);
+        int lineShift = int(countOf<'\n'>(text.data(), text.data() + text.size())) - int(countOf<'\n'>(removed.data(), removed.data() + removed.size()));
+        m_source.replace(offset, length, text);
+
+        // The state at the checkpoints at or before the edit is unchanged, as it only depends on the source before them.
+        size_t restart = 0;
+        while (!m_restartAtStart && restart + 1 < m_checkpoints.size() && m_checkpoints[restart + 1].begin <= offset)
+            restart++;
+
+        // The output before a checkpoint still depends on the source after it up to the first token, which may be a literal to merge.
+        // Identifier characters just before the edit may become the prefix of such a literal.
+        while (restart > 0) {
+            std::string_view before = std::string_view(m_source).substr(m_checkpoints[restart].begin, offset - m_checkpoints[restart].begin);
+            while (!before.empty() && FxCharClass::isIdentifier(before.back()))
+                before.remove_suffix(1);
+            if (!FxExtractor::isGap(before))
+                break;
+            restart--;
+        }
+
+        // The old checkpoints after the edit, at their new source positions, are where the extraction can converge.
+        size_t converge = restart + 1;
+        while (converge < m_checkpoints.size() && m_checkpoints[converge].begin < offset + length)
+            converge++;
+        bool lineDirectives = m_options.lineDirectives && !m_options.sourceMap;
+        if (m_restartAtStart || (lineShift != 0 && lineDirectives))
+            converge = m_checkpoints.size();
+        for (size_t i = converge; i < m_checkpoints.size(); i++) {
+            m_checkpoints[i].begin = size_t(ptrdiff_t(m_checkpoints[i].begin) + shift);
+            m_checkpoints[i].lineNo += lineShift;
+        }
+
+        return extractFrom(restart, converge, lineShift);
+    }
+
+    const std::string& source() const { return m_source; }
+    const std::string& output() const { return m_output; }
+    const std::vector<FxMapEntry>& sourceMap() const { return m_map; }
+
+    // Whether the source was extracted without errors, and the errors if not. The output is then only complete up to the last one.
+    bool ok() const { return m_diagnostics.empty(); }
+    const std::vector<FxDiagnostic>& diagnostics() const { return m_diagnostics; }
+
+private:
+    struct Checkpoint {
+        size_t begin;           // Source offset, at a line start.
+        int lineNo;
+        size_t outputBegin;     // Output offset of the extracted part starting here, at a line start.
+        size_t outputLine;      // Number of lines of output before outputBegin.
+        size_t mapBegin;        // Index of the first source map entry of the part.
+    };
+
+    // Extract the source from checkpoint restart on, until a part ends at checkpoint converge or a later one, keeping the output
+    // from there on, which lineShift more lines of source precede.
+    Change extractFrom(size_t restart, size_t converge, int lineShift) {
+        Checkpoint start = m_checkpoints[restart];
+        std::vector<Checkpoint> tail(m_checkpoints.begin() + ptrdiff_t(converge), m_checkpoints.end());
+        m_checkpoints.resize(restart);
+
+        // The old errors before the restart checkpoint are kept, the others may be found again.
+        std::vector<FxDiagnostic> diagnostics = std::exchange(m_diagnostics, {});
+        auto after = std::find_if(diagnostics.begin(), diagnostics.end(), [&](auto& diagnostic) { return diagnostic.line >= start.lineNo; });
+        m_diagnostics.assign(diagnostics.begin(), after);
+        diagnostics.erase(diagnostics.begin(), after);
+        size_t kept = m_diagnostics.size();
+
+        Change change;
+        change.outputBegin = start.outputBegin;
+        change.mapBegin = start.mapBegin;
+        std::string output;
+        std::vector<FxMapEntry> map;
+        Checkpoint pos = start;
+        size_t next = 0;            // First checkpoint in tail at or after pos.
+        while (true) {
+            while (next < tail.size() && tail[next].begin < pos.begin)
+                next++;
+            // The part at the start has the initial #line directive, so the old one can't be kept there. The old output is also only
+            // kept if as many errors as before precede it, as the errors left to report affect it.
+            auto oldTail = std::find_if(diagnostics.begin(), diagnostics.end(), [&](auto& diagnostic) { return diagnostic.line + lineShift >= pos.lineNo; });
+            if (next < tail.size() && tail[next].begin == pos.begin && tail[next].lineNo == pos.lineNo && pos.begin != 0 &&
+                m_diagnostics.size() == kept + size_t(oldTail - diagnostics.begin())) {
+                keepTail(tail, next, pos, output, map, change, lineShift);
+                for (auto diagnostic = oldTail; diagnostic != diagnostics.end(); ++diagnostic) {
+                    diagnostic->line += lineShift;
+                    m_diagnostics.push_back(*diagnostic);         // An error in the old output kept.
+                }
+                return change;
+            }
+            if (pos.begin == m_source.size() && pos.begin != 0)
+                break;
+
+            m_checkpoints.push_back(pos);
+            size_t limit = pos.begin + m_chunkSize;
+            if (next < tail.size())
+                limit = std::clamp(tail[next].begin, pos.begin + 1, limit);     // To end at the old checkpoint if the state converged.
+
+            std::string part;
+            FxStringSink sink(part);
+            FxOptions options = m_options;
+            options.maxErrors = m_options.maxErrors - int(m_diagnostics.size());       // The errors left to report.
+            FxExtractor extractor(sink, std::string_view(m_source).substr(pos.begin), options);
+            if (m_restartAtStart)
+                extractor.process(m_diagnostics);
+            else
+                extractor.processPart(m_diagnostics, pos.lineNo, limit - pos.begin);
+            for (FxMapEntry entry : extractor.sourceMap()) {
+                entry.offset += uint32_t(pos.outputBegin);
+                entry.outLine += uint32_t(pos.outputLine);
+                map.push_back(entry);
+            }
+            output += part;
+            pos.begin = size_t(extractor.position() - m_source.data());
+            pos.lineNo = extractor.lineNo();
+            pos.outputBegin += part.size();
+            pos.outputLine += countOf<'\n'>(part.data(), part.data() + part.size());
+            pos.mapBegin += extractor.sourceMap().size();
+            if (extractor.stopped() || m_restartAtStart || pos.begin == m_source.size())
+                break;
+        }
+
+        // Everything after the restart checkpoint was extracted again.
+        change.removedOutput = m_output.size() - start.outputBegin;
+        change.removedEntries = m_map.size() - start.mapBegin;
+        m_output.replace(start.outputBegin, std::string::npos, output);
+        m_map.resize(start.mapBegin);
+        m_map.insert(m_map.end(), map.begin(), map.end());
+        change.outputEnd = m_output.size();
+        change.mapEnd = m_map.size();
+        return change;
+    }
+
+    // Splice the new output and map before the old ones from tail[next], which pos has converged with, on.
+    void keepTail(std::vector<Checkpoint>& tail, size_t next, const Checkpoint& pos, const std::string& output, const std::vector<FxMapEntry>& map,
+                  Change& change, int lineShift) {
+        const Checkpoint& old = tail[next];
+        change.removedOutput = old.outputBegin - change.outputBegin;
+        change.removedEntries = old.mapBegin - change.mapBegin;
+        m_output.replace(change.outputBegin, change.removedOutput, output);
+        m_map.erase(m_map.begin() + ptrdiff_t(change.mapBegin), m_map.begin() + ptrdiff_t(old.mapBegin));
+        m_map.insert(m_map.begin() + ptrdiff_t(change.mapBegin), map.begin(), map.end());
+        change.outputEnd = pos.outputBegin;
+        change.mapEnd = pos.mapBegin;
+
+        ptrdiff_t outputShift = ptrdiff_t(pos.outputBegin) - ptrdiff_t(old.outputBegin);
+        ptrdiff_t outputLineShift = ptrdiff_t(pos.outputLine) - ptrdiff_t(old.outputLine);
+        ptrdiff_t mapShift = ptrdiff_t(pos.mapBegin) - ptrdiff_t(old.mapBegin);
+        for (size_t i = change.mapEnd; i < m_map.size(); i++) {
+            m_map[i].offset = uint32_t(m_map[i].offset + outputShift);
+            m_map[i].outLine = uint32_t(m_map[i].outLine + outputLineShift);
+            m_map[i].line = uint32_t(int(m_map[i].line) + lineShift);
+        }
+        for (size_t i = next; i < tail.size(); i++) {
+            Checkpoint checkpoint = tail[i];
+            checkpoint.outputBegin = size_t(ptrdiff_t(checkpoint.outputBegin) + outputShift);
+            checkpoint.outputLine = size_t(ptrdiff_t(checkpoint.outputLine) + outputLineShift);
+            checkpoint.mapBegin = size_t(ptrdiff_t(checkpoint.mapBegin) + mapShift);
+            m_checkpoints.push_back(checkpoint);
+        }
+    }
+
+    std::string m_source;
+    FxOptions m_options;
+    size_t m_chunkSize;
+    bool m_restartAtStart;          // The state at line starts depends on all lines before, so always extract from the start.
+    std::vector<Checkpoint> m_checkpoints;
+    std::string m_output;
+    std::vector<FxMapEntry> m_map;
+    std::vector<FxDiagnostic> m_diagnostics;
+};
@@ -0,0 +1,358 @@
+// Throughput benchmark for the f/x literal extractor.
+// By bengt.gustafsson@beamways.com
+// MIT license.
+
+// Generates synthetic corpora exercising the different paths of FxExtractor, runs extractFx on each and reports MB/s, lines/s
+// and the peak resident set size. The corpora are reproducible, so results can be saved and later used as a baseline to
+// catch regressions.
+
+#include "extract_fx.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Peak resident set size of the process, in bytes.
+size_t peakRss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return size_t(usage.ru_maxrss);             // Bytes on macOS
+#else
+    return size_t(usage.ru_maxrss) * 1024;      // Kilobytes elsewhere
+#endif
+#endif
+}
+
+// Source text generator. Uses the raw engine output rather than the std distributions, which are not specified exactly, so
+// that a corpus is the same on all platforms.
+class CorpusWriter {
+public:
+    explicit CorpusWriter(uint32_t seed) : m_random(seed) {}
+
+    int pick(int count) { return int(m_random() % uint32_t(count)); }
+    std::string_view pick(std::initializer_list<std::string_view> alternatives) { return alternatives.begin()[pick(int(alternatives.size()))]; }
+    std::string name() { return std::format("{}_{}", pick({ "value", "count", "item", "ptr", "total", "index", "elem" }), pick(1000)); }
+
+    std::string& text() { return m_text; }
+
+private:
+    std::mt19937 m_random;
+    std::string m_text;
+};
+
+// Ordinary code without f/x literals, but with plain string and char literals, so the prefilter can't skip it.
+void plainCode(CorpusWriter& w)
+{
+    std::string& out = w.text();
+    out += std::format("int function_{}(const std::vector<int>& {}, int {})\n{{\n", w.pick(100000), w.name(), w.name());
+    int lines = 5 + w.pick(20);
+    for (int i = 0; i < lines; i++) {
+        switch (w.pick(6)) {
+        case 0:
+            out += std::format("    int {} = compute({}, {}) + {};\n", w.name(), w.name(), w.name(), w.pick(1000));
+            break;
+        case 1:
+            out += std::format("    if ({} > {} && {}[{}] != '\\n')\n        return {};\n", w.name(), w.pick(100), w.name(), w.pick(10), w.name());
+            break;
+        case 2:
+            out += std::format("    std::cout << \"The {} is \" << {} << '\\n';    // Print it\n", w.name(), w.name());
+            break;
+        case 3:
+            out += std::format("    for (auto& {} : {}) {{ {} += {} * {}; }}\n", w.name(), w.name(), w.name(), w.name(), w.pick(17));
+            break;
+        case 4:
+            out += "\n";
+            break;
+        default:
+            out += std::format("    {}.push_back(std::max({}, {}));\n", w.name(), w.name(), w.name());
+            break;
+        }
+    }
+    out += "    return 0;\n}\n\n";
+}
+
+// f and x literals with many expression-fields, format-specs, nested fields and = debug fields.
+void denseLiterals(CorpusWriter& w)
+{
+    std::string& out = w.text();
+    switch (w.pick(4)) {
+    case 0:
+        out += std::format("    log(f\"item {{{}}} of {{{}:>8}} took {{{}.count():.3f}} ms, ratio {{{} / {} = }}\");\n", w.name(), w.name(), w.name(), w.name(), w.name());
+        break;
+    case 1:
+        out += std::format("    std::cout << f\"{{{}:{{{}}}.{{{}}}}} {{{}[{}]}} {{{} ? {} : {}}}\\n\";\n", w.name(), w.name(), w.name(), w.name(), w.pick(10), w.name(), w.name(), w.name());
+        break;
+    case 2:
+        out += std::format("    auto {} = x\"{{{}}}, {{{}}}, {{{}}}, {{{}}}\";\n", w.name(), w.name(), w.name(), w.name(), w.name());
+        break;
+    default:
+        out += std::format("    print(Lf\"{{{}=}} {{std::string(\"{}\")}} {{{}(a, b)}}\");\n", w.name(), w.name(), w.name());
+        break;
+    }
+}
+
+// f-literals with f-literals in their expression-fields.
+void nestedLiterals(CorpusWriter& w)
+{
+    std::string& out = w.text();
+    int depth = 2 + w.pick(6);
+    out += "    auto " + w.name() + " = ";
+    for (int i = 0; i < depth; i++)
+        out += std::format("f\"level {} {{{} + ", i, w.name());
+    out += w.name();
+    for (int i = 0; i < depth; i++)
+        out += "}\"";
+    out += ";\n";
+}
+
+// Large raw literals, with braces, quotes and things which look like comments in them, some of them fR literals.
+void rawLiterals(CorpusWriter& w)
+{
+    std::string& out = w.text();
+    bool fx = w.pick(4) == 0;
+    out += std::format("const char* {} = {}R\"delim(\n", w.name(), fx ? "f" : "");
+    int lines = 50 + w.pick(200);
+    for (int i = 0; i < lines; i++) {
+        if (fx && w.pick(10) == 0)
+            out += std::format("    field {{{}}} here\n", w.name());
+        else if (fx)
+            out += std::format("    \"{}\" /* {} */ {{{{ {} }}}} \\n\n", w.name(), w.name(), w.name());
+        else
+            out += std::format("    \"{}\" /* {} */ {{ {} }} ) \\n\n", w.name(), w.name(), w.name());
+    }
+    out += ")delim\";\n\n";
+}
+
+// Long block comments, with f-literal lookalikes, quotes and stars inside.
+void longComments(CorpusWriter& w)
+{
+    std::string& out = w.text();
+    out += "/*\n";
+    int lines = 20 + w.pick(100);
+    for (int i = 0; i < lines; i++)
+        out += std::format(" * The {} uses f\"{{{}}}\" to show it's value. ** \"Don't\" worry / about {}.\n", w.name(), w.name(), w.name());
+    out += " */\n";
+    plainCode(w);
+}
+
+// Preprocessor heavy header with continued macro definitions, conditionals and includes.
+void defineHeaders(CorpusWriter& w)
+{
+    std::string& out = w.text();
+    switch (w.pick(4)) {
+    case 0:
+        out += std::format("#define MACRO_{}(a, b) \\\n    do {{ \\\n        if ((a) > (b)) \\\n            {}(\"a > b\", a, b); \\\n    }} while (false)\n", w.pick(100000), w.name());
+        break;
+    case 1:
+        out += std::format("#if defined(FEATURE_{}) && FEATURE_{} > {}\n#include <{}.h>\n#endif\n", w.pick(1000), w.pick(1000), w.pick(10), w.name());
+        break;
+    case 2:
+        out += std::format("#define LOG_{}(x) log(f\"{{x}} at line {{__LINE__}}\")\n", w.pick(100000));
+        break;
+    default:
+        out += std::format("#define CONSTANT_{} {}   // \"{}\"\n", w.pick(100000), w.pick(100000), w.name());
+        break;
+    }
+}
+
+struct Corpus {
+    std::string name;
+    uint32_t seed;
+    std::function<void(CorpusWriter&)> generator;
+};
+
+const Corpus corpora[] = {
+    { "plain", 1, plainCode },
+    { "dense_f", 2, denseLiterals },
+    { "nested_f", 3, nestedLiterals },
+    { "raw", 4, rawLiterals },
+    { "comments", 5, longComments },
+    { "defines", 6, defineHeaders },
+};
+
+// Generate a corpus of about size bytes.
+std::string generate(const Corpus& corpus, size_t size)
+{
+    CorpusWriter writer(corpus.seed);
+    writer.text().reserve(size + 65536);
+    while (writer.text().size() < size)
+        corpus.generator(writer);
+
+    return std::move(writer.text());
+}
+
+struct BenchResult {
+    double mbPerSecond = 0;
+    double linesPerSecond = 0;
+    size_t peakRss = 0;
+};
+
+// Run extractFx on input iterations times and report the fastest run.
+BenchResult run(const Corpus& corpus, std::string_view input, const FxOptions& options, int iterations)
+{
+    std::string output;
+    output.reserve(input.size() * 2);
+    size_t lines = size_t(std::count(input.begin(), input.end(), '\n'));
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++) {
+        output.clear();
+        auto start = std::chrono::steady_clock::now();
+        FxResult result = extractFx(input, output, options);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (!result.ok)
+            throw std::runtime_error(std::format("Corpus {} failed to extract: {}", corpus.name, result.diagnostics.empty() ? "" : result.diagnostics[0].message));
+
+        best = std::min(best, elapsed.count());
+    }
+
+    BenchResult ret;
+    ret.mbPerSecond = double(input.size()) / (1024 * 1024) / best;
+    ret.linesPerSecond = double(lines) / best;
+    ret.peakRss = peakRss();
+    return ret;
+}
+
+// Baseline files have one line per corpus: name MB/s lines/s.
+std::map<std::string, BenchResult> readBaseline(const std::filesystem::path& path)
+{
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error(std::format("Could not open baseline file {}", path.string()));
+
+    std::map<std::string, BenchResult> ret;
+    std::string line;
+    while (getline(in, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        BenchResult result;
+        if (fields >> name >> result.mbPerSecond >> result.linesPerSecond)
+            ret[name] = result;
+    }
+    return ret;
+}
+
+const char* usage =
+    "Usage: extract_fx_bench [--size <MB>] [-n <iterations>] [--corpus <name>] [--save <file>] [--baseline <file> [--tolerance <percent>]]\n"
+    "                        [--write-corpus <dir>]\n"
+    "Runs extractFx on synthetic corpora and reports the best MB/s and lines/s of the iterations, and the peak RSS so far,\n"
+    "use --corpus to get the peak RSS of one corpus.\n"
+    "--save writes the results to a file which can later be given to --baseline. With --baseline the run fails if any corpus\n"
+    "is more than tolerance percent (default 10) slower than in the baseline. --write-corpus saves the corpora as .cpp files.\n"
+    "Corpora: plain, dense_f, nested_f, raw, comments, defines.\n";
+
+int main(int argc, char** argv)
+{
+    size_t size = 16 * 1024 * 1024;
+    int iterations = 5;
+    std::string only;
+    std::filesystem::path savePath, baselinePath, corpusDir;
+    double tolerance = 10;
+
+    for (int argn = 1; argn < argc; argn++) {
+        std::string_view arg = argv[argn];
+        if (argn + 1 >= argc || arg == "-h" || arg == "--help") {
+            std::cerr << usage;
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+
+        const char* value = argv[++argn];
+        if (arg == "--size")
+            size = size_t(std::atof(value) * 1024 * 1024);
+        else if (arg == "-n")
+            iterations = std::max(1, std::atoi(value));
+        else if (arg == "--corpus")
+            only = value;
+        else if (arg == "--save")
+            savePath = value;
+        else if (arg == "--baseline")
+            baselinePath = value;
+        else if (arg == "--tolerance")
+            tolerance = std::atof(value);
+        else if (arg == "--write-corpus")
+            corpusDir = value;
+        else {
+            std::cerr << "Unknown option " << arg << "\n" << usage;
+            return 1;
+        }
+    }
+
+    try {
+        std::map<std::string, BenchResult> baseline;
+        if (!baselinePath.empty())
+            baseline = readBaseline(baselinePath);
+
+        std::ofstream save;
+        if (!savePath.empty()) {
+            save.open(savePath);
+            if (!save)
+                throw std::runtime_error(std::format("Could not open {} for writing", savePath.string()));
+        }
+
+        FxOptions options;
+        options.sourceFile = "bench.cpp";
+        options.prefilter = false;      // The plain corpus would otherwise be copied without being parsed.
+        int regressions = 0;
+        std::cout << std::format("{:<10} {:>8} {:>10} {:>14} {:>10}{}\n", "corpus", "MB", "MB/s", "lines/s", "peak RSS", baseline.empty() ? "" : "  vs baseline");
+        for (auto& corpus : corpora) {
+            if (!only.empty() && corpus.name != only)
+                continue;
+
+            std::string input = generate(corpus, size);
+            if (!corpusDir.empty()) {
+                std::filesystem::create_directories(corpusDir);
+                std::ofstream(corpusDir / (corpus.name + ".cpp"), std::ios::binary) << input;
+            }
+
+            BenchResult result = run(corpus, input, options, iterations);
+            std::cout << std::format("{:<10} {:>8.1f} {:>10.1f} {:>14.0f} {:>8.1f}MB", corpus.name, double(input.size()) / (1024 * 1024),
+                                     result.mbPerSecond, result.linesPerSecond, double(result.peakRss) / (1024 * 1024));
+
+            auto base = baseline.find(corpus.name);
+            if (base != baseline.end()) {
+                double change = (result.mbPerSecond / base->second.mbPerSecond - 1) * 100;
+                bool regression = change < -tolerance;
+                regressions += regression;
+                std::cout << std::format("  {:+7.1f}%{}", change, regression ? "  REGRESSION" : "");
+            }
+            std::cout << std::endl;
+
+            if (save.is_open())
+                save << corpus.name << ' ' << result.mbPerSecond << ' ' << result.linesPerSecond << '\n';
+        }
+
+        if (regressions > 0) {
+            std::cerr << regressions << " corpora are more than " << tolerance << "% slower than the baseline.\n";
+            return 1;
+        }
+    }
+    catch (const std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -3,19 +3,242 @@
 
 #include <print>
 #include <format>
+#include <algorithm>
 #include <memory>
 #include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <cstdio>
+
+#include "fx_core.h"
 
 // This class just exists to avoid _any_ string from being passable to print. I don't know why this would be important, but it seems that this was the initiator of the f/x subdivision.
 class extracted_string : public std::string {
 };
 
-template<size_t Count, typename... Args> auto extract_string(std::format_string<Args...> fmt, Args&&... args) {
+// Characters reserved for each formatted field on top of the static text of the literal.
+inline constexpr size_t extracted_field_reserve = 16;
+
+// Count is the number of extracted expressions and StaticLen the length of the literal text outside of replacement fields, both
+// provided by extract_fx when --name ends in ** (a single * gives only Count).
+template<size_t Count, size_t StaticLen = 0, typename... Args> auto extract_string(std::format_string<Args...> fmt, Args&&... args) {
     static_assert(Count == sizeof...(Args), "Too many extracted expressions, did you use operator comma?");
-    return extracted_string(std::format(std::move(fmt), std::forward<Args>(args)...));
+    extracted_string ret;
+    std::string& str = ret;         // Format through a std::string back_inserter, which the library can append to efficiently.
+    str.reserve(StaticLen + Count * extracted_field_reserve);
+    std::format_to(std::back_inserter(str), std::move(fmt), std::forward<Args>(args)...);
+    return ret;
 }
 
 // Has to be repeated for each other function we want f literals to work with, and which does not take a
 // std::string today... there should not be many.
 inline void print(const extracted_string& str) { std::cout << str; }
 inline void println(const extracted_string& str) { std::cout << str << "\n"; }     // Or maybe endl?
+
+
+
+// Inline capacity of inline_string when not given, define EXTRACT_FX_INLINE_CAPACITY before including this file to change it.
+#ifndef EXTRACT_FX_INLINE_CAPACITY
+#define EXTRACT_FX_INLINE_CAPACITY 128
+#endif
+
+// f-literal result keeping up to Capacity characters inline, only allocating for longer results. Use --name inline_format** for
+// the default capacity or for instance --name inline_string<64>::format** for another one.
+template<size_t Capacity = EXTRACT_FX_INLINE_CAPACITY> class inline_string {
+public:
+    inline_string() = default;
+    inline_string(const inline_string&) = default;
+    inline_string& operator=(const inline_string&) = default;
+
+    // Moving leaves other empty, as its size would otherwise refer to the text moved from its m_heap.
+    inline_string(inline_string&& other) noexcept : m_size(std::exchange(other.m_size, 0)), m_heap(std::move(other.m_heap)) {
+        std::copy_n(other.m_buffer, std::min(m_size, Capacity), m_buffer);
+    }
+    inline_string& operator=(inline_string&& other) noexcept {
+        m_size = std::exchange(other.m_size, 0);
+        m_heap = std::move(other.m_heap);
+        std::copy_n(other.m_buffer, std::min(m_size, Capacity), m_buffer);
+        return *this;
+    }
+
+    template<size_t Count, size_t StaticLen = 0, typename... Args> static inline_string format(std::format_string<Args...> fmt, Args&&... args) {
+        static_assert(Count == sizeof...(Args), "Too many extracted expressions, did you use operator comma?");
+        inline_string ret;
+        ret.m_size = size_t(std::format_to_n(ret.m_buffer, Capacity, fmt, std::forward<Args>(args)...).size);
+        if (ret.m_size > Capacity) {        // Didn't fit, format again on the heap. Formatting never moves from args.
+            ret.m_heap.reserve(ret.m_size);
+            std::format_to(std::back_inserter(ret.m_heap), std::move(fmt), std::forward<Args>(args)...);
+        }
+        return ret;
+    }
+
+    const char* data() const { return m_size <= Capacity ? m_buffer : m_heap.data(); }
+    size_t size() const { return m_size; }
+    std::string_view view() const { return { data(), m_size }; }
+    std::string str() const { return std::string(view()); }
+
+    operator std::string_view() const { return view(); }
+    operator std::string() const { return str(); }
+
+    friend std::ostream& operator<<(std::ostream& out, const inline_string& str) { return out << str.view(); }
+
+private:
+    char m_buffer[Capacity];
+    size_t m_size = 0;
+    std::string m_heap;         // Only used if m_size > Capacity
+};
+
+template<size_t Count, size_t StaticLen = 0, typename... Args> auto inline_format(std::format_string<Args...> fmt, Args&&... args) {
+    return inline_string<>::format<Count, StaticLen>(std::move(fmt), std::forward<Args>(args)...);
+}
+
+template<size_t Capacity> void print(const inline_string<Capacity>& str) { std::cout << str; }
+template<size_t Capacity> void println(const inline_string<Capacity>& str) { std::cout << str << "\n"; }
+
+// Lazily formatted f-literal, returned by defer_string. It holds the format string and the arguments and formats straight into
+// the stream when printed, or into a std::string when converted to one. Arguments which are temporaries are moved into it while
+// others are referenced, so like a lambda capturing by reference it can be kept in an auto variable as long as the variables
+// used in the fields outlive it.
+template<size_t StaticLen, typename... Args> class deferred_string {
+public:
+    deferred_string(std::format_string<Args...> fmt, Args&&... args) : m_fmt(fmt.get()), m_args(std::forward<Args>(args)...) {}
+    deferred_string(const deferred_string&) = delete;
+    deferred_string& operator=(const deferred_string&) = delete;
+
+    template<typename Out> Out format_to(Out out) const {
+        return std::apply([&](auto&... args) { return std::vformat_to(std::move(out), m_fmt, std::make_format_args(args...)); }, m_args);
+    }
+
+    void print(std::FILE* stream) const {
+        std::apply([&](auto&... args) { std::vprint_unicode(stream, m_fmt, std::make_format_args(args...)); }, m_args);
+    }
+
+    std::string str() const {
+        std::string ret;
+        ret.reserve(StaticLen + sizeof...(Args) * extracted_field_reserve);
+        format_to(std::back_inserter(ret));
+        return ret;
+    }
+    operator std::string() const { return str(); }
+
+    friend std::ostream& operator<<(std::ostream& out, const deferred_string& str) {
+        str.format_to(std::ostreambuf_iterator<char>(out));
+        return out;
+    }
+
+private:
+    std::string_view m_fmt;
+    std::tuple<Args...> m_args;     // Lvalue arguments are references, temporaries values.
+};
+
+// Format a deferred_string used as the field of another f-literal, with the format-spec of a string.
+template<size_t StaticLen, typename... Args> struct std::formatter<deferred_string<StaticLen, Args...>> : std::formatter<std::string_view> {
+    template<typename FormatContext> auto format(const deferred_string<StaticLen, Args...>& str, FormatContext& ctx) const {
+        return std::formatter<std::string_view>::format(str.str(), ctx);
+    }
+};
+
+// Use --name defer_string** to have f-literals create deferred_string objects.
+template<size_t Count, size_t StaticLen = 0, typename... Args> auto defer_string(std::format_string<Args...> fmt, Args&&... args) {
+    static_assert(Count == sizeof...(Args), "Too many extracted expressions, did you use operator comma?");
+    return deferred_string<StaticLen, Args...>(fmt, std::forward<Args>(args)...);
+}
+
+template<size_t StaticLen, typename... Args> void print(const deferred_string<StaticLen, Args...>& str) { std::cout << str; }
+template<size_t StaticLen, typename... Args> void println(const deferred_string<StaticLen, Args...>& str) { std::cout << str << "\n"; }
+template<size_t StaticLen, typename... Args> void print(std::FILE* stream, const deferred_string<StaticLen, Args...>& str) { str.print(stream); }
+template<size_t StaticLen, typename... Args> void println(std::FILE* stream, const deferred_string<StaticLen, Args...>& str) {
+    str.print(stream);
+    std::fputc('\n', stream);
+}
+
+
+
+// Compile time f-literals for fields which are just names, which need no extract_fx build step. The text is a plain string literal
+// and the fields are given again as arguments, which are checked against the names in the text:
+//
+//     std::cout << FX_STRING("{name} is {age:>3} years", name, age);
+//
+// FX_STRING creates an extracted_string, FX_CALL(function, text, ...) calls function like --name function would, and
+// FX_CALL_COUNTED(function, text, ...) like --name function**. The fields are split by fxSplitFields() in fx_core.h, which
+// accepts names such as value, ns::value, obj.size or ptr->size, and format-specs with nested fields of such names.
+
+// Text of a string literal as a template argument.
+template<size_t N> struct fx_text {
+    consteval fx_text(const char (&text)[N]) {
+        for (size_t i = 0; i < N; i++)
+            chars[i] = text[i];
+    }
+    constexpr std::string_view view() const { return { chars, N - 1 }; }
+
+    char chars[N];
+};
+
+// True if names and arguments, the stringized argument list, are the same comma separated names, not counting spaces.
+constexpr bool fx_same_names(std::string_view names, std::string_view arguments) {
+    auto skip = [](std::string_view& text) {
+        while (!text.empty() && FxCharClass::isSpace(text.front()))
+            text.remove_prefix(1);
+    };
+    while (true) {
+        skip(names);
+        skip(arguments);
+        if (names.empty() || arguments.empty())
+            return names.empty() && arguments.empty();
+        if (names.front() != arguments.front())
+            return false;
+
+        names.remove_prefix(1);
+        arguments.remove_prefix(1);
+    }
+}
+
+// A format text with simple fields split at compile time. format is the std::format string with the names removed, count the number
+// of fields and static_length the length of the text outside them.
+template<fx_text Text> class fx_literal {
+    struct split_result {
+        std::array<char, sizeof(Text.chars)> format{};      // Never longer than the text.
+        size_t format_length = 0;
+        std::array<char, sizeof(Text.chars) * 2> names{};   // Comma separated.
+        size_t names_length = 0;
+        size_t count = 0;
+        const char* error = nullptr;
+    };
+
+    static consteval split_result split() {
+        split_result ret;
+        ret.error = fxSplitFields(Text.view(), [&](std::string_view part) {
+            for (char c : part)
+                ret.format[ret.format_length++] = c;
+        }, [&](std::string_view name) {
+            if (ret.count++ != 0)
+                ret.names[ret.names_length++] = ',';
+            for (char c : name)
+                ret.names[ret.names_length++] = c;
+        });
+        return ret;
+    }
+
+    static constexpr split_result parts = split();
+    static_assert(parts.error == nullptr, "The text is not a valid compile time f-literal, see fxSplitFields() in fx_core.h.");
+
+public:
+    static constexpr size_t count = parts.count;
+    static constexpr std::string_view format{ parts.format.data(), parts.format_length };
+    static constexpr size_t static_length = fxStaticLength(format);
+
+    // The format string, after checking that Arguments, the stringized argument list, names the fields in order.
+    template<fx_text Arguments> static consteval std::string_view checked_format() {
+        static_assert(fx_same_names(std::string_view(parts.names.data(), parts.names_length), Arguments.view()),
+                      "The arguments must be the names of the fields, in order.");
+        return format;
+    }
+};
+
+#define FX_CALL(function, text, ...) function(fx_literal<text>::checked_format<#__VA_ARGS__>() __VA_OPT__(,) __VA_ARGS__)
+#define FX_CALL_COUNTED(function, text, ...) function<fx_literal<text>::count, fx_literal<text>::static_length>( \
+    fx_literal<text>::checked_format<#__VA_ARGS__>() __VA_OPT__(,) __VA_ARGS__)
+#define FX_STRING(text, ...) FX_CALL_COUNTED(extract_string, text __VA_OPT__(,) __VA_ARGS__)
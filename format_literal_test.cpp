@@ -4,6 +4,7 @@
 
 #include "format_literal.h"
 #include <iostream>
+#include <sstream>
 
 #define FSTRING f"Number: {3}"
 
@@ -16,6 +17,51 @@ using std::println;         // Add std::println to overload set.
 
 extern void extratest();
 
+// Check that a deferred_string prints, converts to std::string and formats as the field of another literal, also when kept in a
+// variable after the temporaries it was created from are gone, and that it refers to the variables it was created from.
+bool testDeferredString()
+{
+    int value = 17;
+    std::string name = "Value";
+    std::ostringstream out;
+    out << defer_string<2, 4>("{} is {}", name, value);
+    std::string str = defer_string<2, 4>("{} is {}", name, value);
+    auto kept = defer_string<2, 4>("{} is {}", name + "s", value * 2);
+    std::string nested = std::format("[{:>14}]", kept);
+    auto referring = defer_string<1, 0>("{}", value);
+    value = 18;
+    if (out.str() != "Value is 17" || str != "Value is 17" || nested != "[  Values is 34]" || kept.str() != "Values is 34" || referring.str() != "18") {
+        std::cerr << "ERROR in deferred_string test: Got " << out.str() << ", " << str << ", " << nested << ", " << kept << " and " << referring << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Check that an inline_string keeps a result which fits inline and formats a longer one on the heap, converts to std::string_view
+// and std::string, and can be moved, leaving the string moved from empty.
+bool testInlineString()
+{
+    auto isInline = [](const inline_string<8>& str) {
+        const char* object = reinterpret_cast<const char*>(&str);
+        return str.data() >= object && str.data() < object + sizeof(str);
+    };
+    inline_string<8> fits = inline_string<8>::format<1, 3>("ab {}", 12345);
+    inline_string<8> overflows = inline_string<8>::format<1, 3>("ab {}", std::string(40, 'c'));     // Too long for the std::string SSO too.
+    std::string_view view = fits;
+    std::string str = overflows;
+    bool ok = isInline(fits) && !isInline(overflows) && view == "ab 12345" && str == "ab " + std::string(40, 'c');
+
+    inline_string<8> movedFits = std::move(fits);
+    inline_string<8> movedOverflows;
+    movedOverflows = std::move(overflows);
+    ok = ok && movedFits.view() == "ab 12345" && movedOverflows.str() == str && fits.view().empty() && overflows.view().empty();
+    if (!ok) {
+        std::cerr << "ERROR in inline_string test: Got " << movedFits << " and " << movedOverflows << "\n";
+        return false;
+    }
+    return true;
+}
+
 int main()
 {
     // println(f"Number: {1, 2}, {2.718} and {std::sqrt(2):.{3+1}}");           // This calls the println overload in format_literal.
@@ -30,6 +76,14 @@ int main()
     
     int value = 17;
     println(f"{value=}");
+    std::cout << FX_STRING("Value without extraction: {value:>4}", value) << std::endl;
     extratest();
+
+    int failures = 0;
+    if (!testDeferredString())
+        failures++;
+    if (!testInlineString())
+        failures++;
+    return failures;
 }
 
@@ -0,0 +1,188 @@
+// f/x literal extractor for C++ preprocessor.
+// By bengt.gustafsson@beamways.com
+// MIT license.
+
+// constexpr parts of the extraction, shared by extract_fx.h and format_literal.h. Everything here can run at compile time, which
+// lets format_literal.h split f-literals with simple fields without the extract_fx build step.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Character classes of the lexer, looked up in tables built at compile time. Unlike <cctype> this doesn't depend on the locale, only
+// ASCII letters are letters just like in the "C" locale.
+struct FxCharClass {
+    enum : uint8_t { space = 1, digit = 2, alpha = 4, underscore = 8, opening = 16, closing = 32 };
+
+    static constexpr bool isSpace(char c) { return (classes[uint8_t(c)] & space) != 0; }
+    static constexpr bool isDigit(char c) { return (classes[uint8_t(c)] & digit) != 0; }
+    static constexpr bool isAlpha(char c) { return (classes[uint8_t(c)] & alpha) != 0; }
+    static constexpr bool isIdentifier(char c) { return (classes[uint8_t(c)] & (alpha | digit | underscore)) != 0; }
+    static constexpr bool isOpening(char c) { return (classes[uint8_t(c)] & opening) != 0; }
+    static constexpr bool isClosing(char c) { return (classes[uint8_t(c)] & closing) != 0; }
+
+    // The bracket matching an opening or closing bracket.
+    static constexpr char partner(char c) { return partners[uint8_t(c)]; }
+
+    static constexpr std::array<uint8_t, 256> classes = [] {
+        std::array<uint8_t, 256> table{};
+        for (char c : std::string_view(" \t\n\v\f\r"))
+            table[uint8_t(c)] |= space;
+        for (int c = '0'; c <= '9'; c++)
+            table[c] |= digit;
+        for (int c = 'a'; c <= 'z'; c++)
+            table[c] |= alpha;
+        for (int c = 'A'; c <= 'Z'; c++)
+            table[c] |= alpha;
+        table['_'] |= underscore;
+        for (char c : std::string_view("([{"))
+            table[uint8_t(c)] |= opening;
+        for (char c : std::string_view(")]}"))
+            table[uint8_t(c)] |= closing;
+        return table;
+    }();
+
+    static constexpr std::array<char, 256> partners = [] {
+        std::array<char, 256> table{};
+        std::string_view openings = "([{", closings = ")]}";
+        for (size_t i = 0; i < openings.size(); i++) {
+            table[uint8_t(openings[i])] = closings[i];
+            table[uint8_t(closings[i])] = openings[i];
+        }
+        return table;
+    }();
+};
+
+// Length of the text a format string formats to, excluding the replacement fields. Doubled braces count once. Escape sequences are
+// counted as written, which may overestimate a little.
+constexpr size_t fxStaticLength(std::string_view format)
+{
+    size_t ret = 0;
+    for (size_t pos = 0; pos < format.size(); pos++) {
+        if (format[pos] == '{' && pos + 1 < format.size() && format[pos + 1] != '{') {
+            // Skip the replacement field, which may have nested fields in its format-spec.
+            for (int depth = 1; depth > 0 && pos + 1 < format.size(); )
+                depth += format[++pos] == '{' ? 1 : format[pos] == '}' ? -1 : 0;
+        }
+        else {
+            if (format[pos] == '{' || format[pos] == '}')
+                pos++;      // Doubled brace
+            ret++;
+        }
+    }
+    return ret;
+}
+
+// Length of the name of a simple field at the start of text: An identifier, possibly qualified by :: and followed by members
+// accessed using . or ->. Returns 0 if text doesn't start with an identifier.
+constexpr size_t fxSimpleNameLength(std::string_view text)
+{
+    auto identifier = [&](size_t pos) {
+        if (pos >= text.size() || FxCharClass::isDigit(text[pos]) || !FxCharClass::isIdentifier(text[pos]))
+            return pos;
+        while (pos < text.size() && FxCharClass::isIdentifier(text[pos]))
+            pos++;
+        return pos;
+    };
+
+    size_t end = identifier(0);
+    if (end == 0)
+        return 0;
+
+    while (true) {
+        size_t separator = text.substr(end).starts_with("::") || text.substr(end).starts_with("->") ? 2 : text.substr(end).starts_with('.') ? 1 : 0;
+        size_t next = separator != 0 ? identifier(end + separator) : end;
+        if (next == end + separator)
+            return end;         // No identifier after the separator, which is then not part of the name.
+
+        end = next;
+    }
+}
+
+// Split a format text with simple replacement fields, that is fields with only a name, optionally followed by = for a debug field
+// and by a format-spec, which may contain nested simple fields. format is called with the consecutive parts of the format string,
+// which is the text with the names removed just as for f-literals, name is called with each field name in order. Returns nullptr,
+// or a message describing the first error.
+template<typename Format, typename Name> constexpr const char* fxSplitFields(std::string_view text, Format&& format, Name&& name)
+{
+    size_t pos = 0;
+
+    // Pass the name of a field starting at pos, and any spaces after it.
+    auto field = [&]() -> const char* {
+        size_t length = fxSimpleNameLength(text.substr(pos));
+        if (length == 0)
+            return "Only names are allowed in simple fields.";
+
+        name(text.substr(pos, length));
+        pos += length;
+        while (pos < text.size() && FxCharClass::isSpace(text[pos]))
+            pos++;
+        return nullptr;
+    };
+
+    while (pos < text.size()) {
+        if (text[pos] == '}') {
+            if (pos + 1 == text.size() || text[pos + 1] != '}')
+                return "Right brace characters must be doubled in f/x string literals.";
+
+            format(text.substr(pos, 2));
+            pos += 2;
+        }
+        else if (text[pos] != '{') {
+            size_t end = text.find_first_of("{}", pos);
+            if (end == std::string_view::npos)
+                end = text.size();
+            format(text.substr(pos, end - pos));
+            pos = end;
+        }
+        else if (pos + 1 < text.size() && text[pos + 1] == '{') {
+            format(text.substr(pos, 2));
+            pos += 2;
+        }
+        else {
+            size_t begin = ++pos;
+            if (const char* error = field())
+                return error;
+
+            if (pos < text.size() && text[pos] == '=') {       // Debug style field, the name is kept as a label.
+                pos++;
+                while (pos < text.size() && FxCharClass::isSpace(text[pos]))
+                    pos++;
+                format(text.substr(begin, pos - begin));
+            }
+            format("{");
+
+            if (pos < text.size() && text[pos] == ':') {
+                format(":");
+                pos++;
+                while (pos < text.size() && text[pos] != '}') {
+                    if (text[pos] == '{') {         // Nested field
+                        pos++;
+                        if (const char* error = field())
+                            return error;
+                        if (pos == text.size() || text[pos] != '}')
+                            return "Only names are allowed in simple fields.";
+
+                        format("{}");
+                    }
+                    else
+                        format(text.substr(pos, 1));
+                    pos++;
+                }
+            }
+
+            if (pos == text.size())
+                return "Format text ends inside a field.";
+            if (text[pos] != '}')
+                return "Only names are allowed in simple fields.";
+
+            format("}");
+            pos++;
+        }
+    }
+
+    return nullptr;
+}
@@ -1,17 +1,139 @@
+# Directory where extract_fx caches results keyed by input hash, tool version and options. Empty disables the cache.
+set(EXTRACT_FX_CACHE_DIR "" CACHE PATH "Directory for the extract_fx result cache. Empty to disable it.")
+
+# Function f-literals are wrapped in. extract_string** formats to a string right away, defer_string** creates a deferred_string
+# which print and println format straight into the stream, inline_format** creates an inline_string which only allocates for
+# results longer than its inline capacity. See format_literal.h.
+set(EXTRACT_FX_FUNCTION "extract_string**" CACHE STRING "Function to wrap f-literals in.")
+set_property(CACHE EXTRACT_FX_FUNCTION PROPERTY STRINGS "extract_string**" "defer_string**" "inline_format**" "std::format")
+
+# Emit #line directives only where line numbers would otherwise be wrong, without column padding. Makes the extracted files smaller.
+option(EXTRACT_FX_COMPACT_LINES "Only emit the #line directives needed to keep line numbers right." OFF)
+
+# Write a source map next to each extracted file instead of #line directives. Compiler diagnostics can then be translated to input
+# positions by piping them through extract_fx --map-diagnostics.
+option(EXTRACT_FX_SOURCE_MAP "Write source maps for extract_fx --map-diagnostics instead of #line directives." OFF)
+
+# Copy #if 0 and other groups known to be disabled without lexing them, so that for instance apostrophes in them are not errors.
+option(EXTRACT_FX_SKIP_DISABLED "Copy disabled #if groups without lexing them." OFF)
+
+# Also extract the headers included with quotes by the files, found using the include directories of the target, into
+# extracted/include. The extracted files include the extracted headers, and a depfile makes them depend on the headers.
+option(EXTRACT_FX_FOLLOW_INCLUDES "Extract f/x literals in the headers included by the extracted files too." OFF)
+
+# Extract all files of a target with one batched extract_fx command instead of one command per file. The files are processed in
+# parallel by a single process, and rebuilding extract_fx reruns one command per target rather than one per file.
+option(EXTRACT_FX_BATCH "Extract the files of each target with one batched extract_fx command." OFF)
+
+# Extract the files in memory while compiling them, with extract_fx as the compiler launcher of the target, instead of writing
+# extracted files. This is only supported by the Makefile and Ninja generators, and all C++ files of the target are passed through
+# extract_fx. Can't be combined with EXTRACT_FX_SOURCE_MAP or EXTRACT_FX_FOLLOW_INCLUDES.
+option(EXTRACT_FX_LAUNCHER "Extract f/x literals in memory while compiling, with extract_fx as compiler launcher." OFF)
+
 # Macro which takes a cpi file and generates a cpp file in the selected target.
 function(target_fx_sources TARGET)
-    set(EXEC ${CMAKE_CURRENT_BINARY_DIR}/$<CONFIG>/extract_fx)
+    set(EXEC "$<TARGET_FILE:extract_fx>")
+
+    set(FX_ARGS)
+    if (EXTRACT_FX_CACHE_DIR)
+        set(FX_ARGS --cache "${EXTRACT_FX_CACHE_DIR}")
+    endif()
+    if (EXTRACT_FX_COMPACT_LINES)
+        list(APPEND FX_ARGS --compact-lines)
+    endif()
+    if (EXTRACT_FX_SOURCE_MAP)
+        list(APPEND FX_ARGS --source-map)
+    endif()
+    if (EXTRACT_FX_SKIP_DISABLED)
+        list(APPEND FX_ARGS --skip-disabled)
+    endif()
+    if (EXTRACT_FX_FOLLOW_INCLUDES)
+        set(INCLUDES "$<TARGET_PROPERTY:${TARGET},INCLUDE_DIRECTORIES>")
+        list(APPEND FX_ARGS --follow-includes "${CMAKE_CURRENT_BINARY_DIR}/extracted/include" "$<$<BOOL:${INCLUDES}>:-I$<JOIN:${INCLUDES},$<SEMICOLON>-I>>")
+    endif()
     
+    if (EXTRACT_FX_LAUNCHER)
+        # Generator expressions in the launcher need CMake 3.25.
+        if (CMAKE_VERSION VERSION_LESS 3.25 OR NOT CMAKE_GENERATOR MATCHES "Ninja|Makefiles")
+            message(FATAL_ERROR "EXTRACT_FX_LAUNCHER needs CMake 3.25 and a Ninja or Makefile generator.")
+        endif()
+        if (EXTRACT_FX_SOURCE_MAP OR EXTRACT_FX_FOLLOW_INCLUDES)
+            message(FATAL_ERROR "EXTRACT_FX_LAUNCHER can't be combined with EXTRACT_FX_SOURCE_MAP or EXTRACT_FX_FOLLOW_INCLUDES.")
+        endif()
+
+        set(INS)
+        foreach(FILE ${ARGN})
+            list(APPEND INS ${CMAKE_CURRENT_SOURCE_DIR}/${FILE})
+        endforeach()
+        set_property(TARGET "${TARGET}" PROPERTY CXX_COMPILER_LAUNCHER "${EXEC}" --name "${EXTRACT_FX_FUNCTION}" ${FX_ARGS} --launch)
+        add_dependencies("${TARGET}" extract_fx)
+        target_sources("${TARGET}" PRIVATE ${INS})
+        return()
+    endif()
+
+    # DEPFILE is only supported by all generators as of CMake 3.21.
+    set(USE_DEPFILE OFF)
+    if (EXTRACT_FX_FOLLOW_INCLUDES AND (CMAKE_GENERATOR MATCHES "Ninja" OR NOT CMAKE_VERSION VERSION_LESS 3.21))
+        set(USE_DEPFILE ON)
+    endif()
+
+    if (EXTRACT_FX_BATCH)
+        # The list file is only rewritten when its contents change, so reconfiguring doesn't rerun the extraction.
+        set(LIST_FILE ${CMAKE_CURRENT_BINARY_DIR}/extracted/${TARGET}.fxlist)
+        set(LIST_CONTENT)
+        set(INS)
+        set(OUTS)
+        foreach(FILE ${ARGN})
+            set(IN ${CMAKE_CURRENT_SOURCE_DIR}/${FILE})
+            set(OUT ${CMAKE_CURRENT_BINARY_DIR}/extracted/${FILE})
+            string(APPEND LIST_CONTENT "${IN}=${OUT}\n")
+            list(APPEND INS "${IN}")
+            list(APPEND OUTS "${OUT}")
+        endforeach()
+        file(GENERATE OUTPUT "${LIST_FILE}" CONTENT "${LIST_CONTENT}")
+
+        set(DEPFILE_ARGS)
+        set(DEPFILE_OPTION)
+        if (USE_DEPFILE)
+            set(DEPFILE_ARGS --depfile "${LIST_FILE}.d")
+            set(DEPFILE_OPTION DEPFILE "${LIST_FILE}.d")
+        endif()
+
+        # As each output is only written if its contents change the Ninja generator, which gives custom commands restat
+        # semantics, only rebuilds what depends on the outputs that actually changed.
+        add_custom_command(OUTPUT ${OUTS}
+                           DEPENDS extract_fx "${LIST_FILE}" ${INS}
+                           COMMAND "${EXEC}" --name "${EXTRACT_FX_FUNCTION}" ${FX_ARGS} ${DEPFILE_ARGS} --batch "${LIST_FILE}"
+                           ${DEPFILE_OPTION}
+                           COMMENT "Extracting f/x literals of ${TARGET}"
+                           COMMAND_EXPAND_LISTS
+        )
+
+        target_sources("${TARGET}" PRIVATE ${INS} ${OUTS})
+        source_group(Extracted FILES ${OUTS})
+        return()
+    endif()
+
     foreach(FILE ${ARGN})
         set(IN ${CMAKE_CURRENT_SOURCE_DIR}/${FILE})
         set(OUT ${CMAKE_CURRENT_BINARY_DIR}/extracted/${FILE})
+        set(DEPFILE_ARGS)
+        set(DEPFILE_OPTION)
+        if (USE_DEPFILE)
+            set(DEPFILE_ARGS --depfile "${OUT}.d")
+            set(DEPFILE_OPTION DEPFILE "${OUT}.d")
+        endif()
 
         ################################################################
         # Custom command to generate pre-preprocessedd .cpp file in the build directory from .cpp file in the source directory.
+        # extract_fx does not touch an output whose contents are unchanged. The Ninja generator gives custom commands restat
+        # semantics, so then nothing depending on the output is rebuilt, for instance after extract_fx itself was rebuilt.
         add_custom_command(OUTPUT "${OUT}"
                            MAIN_DEPENDENCY "${IN}"
                            DEPENDS extract_fx
-                           COMMAND "${EXEC}" --name extract_string* "${IN}" "${OUT}"
+                           COMMAND "${EXEC}" --name "${EXTRACT_FX_FUNCTION}" ${FX_ARGS} ${DEPFILE_ARGS} "${IN}" "${OUT}"
+                           ${DEPFILE_OPTION}
+                           COMMAND_EXPAND_LISTS
         )
 
         target_sources("${TARGET}" PRIVATE "${IN}" "${OUT}")